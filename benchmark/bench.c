@@ -0,0 +1,220 @@
+#include "../my_vm.h"
+#include <time.h>
+
+// timing harness for the core operations, one CSV row per benchmark:
+//   ./bench [csv file, appended to, stdout without] [label, e.g. the library version]
+// a sample times a batch of ops calls, latencies are per call over the measured samples
+#define warmup_samples 20
+#define measured_samples 400
+#define region_bytes (64 << 20)
+
+typedef void (*bench_fn)(void *arg, int ops);
+
+FILE *csv;
+const char *label = "current";
+volatile uint64_t sink;
+
+double now_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// nearest rank percentile of sorted samples
+double percentile(double *sorted, int n, double p) {
+    int rank = (int)(p / 100 * n + 0.5);
+    if (rank < 1)
+        rank = 1;
+    return sorted[rank - 1];
+}
+
+void bench(const char *name, const char *param, bench_fn fn, void *arg, int ops, int samples) {
+    double *ns = malloc(samples * sizeof(double)), total = 0;
+    for (int i = 0; i < warmup_samples; i++)
+        fn(arg, ops);
+    for (int i = 0; i < samples; i++) {
+        double start = now_ns();
+        fn(arg, ops);
+        ns[i] = (now_ns() - start) / ops;
+        total += ns[i];
+    }
+    qsort(ns, samples, sizeof(double), compare_double);
+    double mean = total / samples;
+    fprintf(csv, "%s,%s,%s,%d,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.0f\n", label, name, param, ops * samples, mean,
+            percentile(ns, samples, 50), percentile(ns, samples, 90), percentile(ns, samples, 99), ns[0],
+            ns[samples - 1], 1e9 / mean);
+    fflush(csv);
+    free(ns);
+}
+
+// translate on a TLB hit: the same page over and over
+void translate_hit(void *arg, int ops) {
+    for (int i = 0; i < ops; i++)
+        sink += translate((address_t)arg);
+}
+
+// translate on a TLB miss: steps one huge mapping and one page at a time, so neither the
+// page entries nor the huge entries can hold the pages in turn
+typedef struct page_cycle {
+    char *base;
+    uint64_t pages;
+    uint64_t next;
+} page_cycle;
+
+void translate_miss(void *arg, int ops) {
+    page_cycle *c = arg;
+    for (int i = 0; i < ops; i++) {
+        sink += translate((address_t)(c->base + c->next * PGSIZE));
+        c->next = (c->next + HUGE_PAGES + 1) % c->pages;
+    }
+}
+
+void alloc_churn(void *arg, int ops) {
+    uint64_t size = *(uint64_t *)arg;
+    for (int i = 0; i < ops; i++) {
+        void *p = umalloc(size);
+        if (p == NULL) {
+            fprintf(stderr, "umalloc(%" PRIu64 ") fails\n", size);
+            exit(1);
+        }
+        ufree(p, size);
+    }
+}
+
+// get_val/put_val of one int at a time over region_bytes
+typedef struct access_pattern {
+    char *base;
+    uint64_t ints;
+    uint64_t index;
+    uint64_t step;  // 0 for random
+    unsigned int seed;
+    bool write;
+} access_pattern;
+
+void access_ints(void *arg, int ops) {
+    access_pattern *a = arg;
+    for (int i = 0; i < ops; i++) {
+        if (a->step == 0)
+            a->index = ((uint64_t)rand_r(&a->seed) << 16 ^ rand_r(&a->seed)) % a->ints;
+        else
+            a->index = (a->index + a->step) % a->ints;
+        int value = i;
+        if (a->write)
+            put_val(a->base + a->index * sizeof(int), &value, sizeof(int));
+        else {
+            get_val(a->base + a->index * sizeof(int), &value, sizeof(int));
+            sink += value;
+        }
+    }
+}
+
+// the same sequential reads through the host pointer of a pinned range
+void pinned_ints(void *arg, int ops) {
+    access_pattern *a = arg;
+    int *base = (int *)a->base;
+    for (int i = 0; i < ops; i++) {
+        a->index = (a->index + 1) % a->ints;
+        sink += base[a->index];
+    }
+}
+
+void pin_unpin(void *arg, int ops) {
+    for (int i = 0; i < ops; i++) {
+        void *direct;
+        vm_unpin(vm_pin(arg, PGSIZE, &direct));
+    }
+}
+
+typedef struct matrices {
+    void *a, *b, *c;
+    int size;
+} matrices;
+
+void multiply(void *arg, int ops) {
+    matrices *m = arg;
+    for (int i = 0; i < ops; i++)
+        mat_mult(m->a, m->b, m->size, m->c);
+}
+
+int main(int argc, char **argv) {
+    csv = stdout;
+    if (argc > 1) {
+        csv = fopen(argv[1], "a");
+        if (csv == NULL) {
+            fprintf(stderr, "cannot open %s\n", argv[1]);
+            return 1;
+        }
+    }
+    if (argc > 2)
+        label = argv[2];
+    // a new file gets the header
+    if (ftell(csv) == 0 || csv == stdout)
+        fprintf(csv, "label,benchmark,param,ops,mean_ns,p50_ns,p90_ns,p99_ns,min_ns,max_ns,ops_per_sec\n");
+
+    char param[64];
+    char *region = umalloc(region_bytes);
+    for (uint64_t offset = 0; offset < region_bytes; offset += PGSIZE)
+        put_val(region + offset, &offset, sizeof(int));
+
+    bench("translate", "tlb_hit", translate_hit, region, 1000, measured_samples);
+    page_cycle cycle = {region, region_bytes / PGSIZE, 0};
+    bench("translate", "tlb_miss", translate_miss, &cycle, 1000, measured_samples);
+
+    // churn at several sizes while fill of the physical memory is held by other allocations
+    uint64_t sizes[] = {16, 256, 4096, 65536, 1 << 20};
+    int fills[] = {0, 50, 90};
+    for (int f = 0; f < 3; f++) {
+        uint64_t fill = (uint64_t)MAX_MEMSIZE / 100 * fills[f], chunk = 16 << 20, held = fill / chunk;
+        void **chunks = calloc(held + 1, sizeof(void *));
+        for (uint64_t k = 0; k < held; k++)
+            chunks[k] = umalloc(chunk);
+        for (int s = 0; s < 5; s++) {
+            snprintf(param, sizeof(param), "%" PRIu64 "B_fill%d%%", sizes[s], fills[f]);
+            bench("umalloc_ufree", param, alloc_churn, &sizes[s], sizes[s] >= (1 << 20) ? 10 : 100, measured_samples / 4);
+        }
+        for (uint64_t k = 0; k < held; k++)
+            ufree(chunks[k], chunk);
+        free(chunks);
+    }
+
+    const char *pattern_name[] = {"sequential", "strided", "random"};
+    uint64_t steps[] = {1, PGSIZE / sizeof(int) + 1, 0};
+    for (int w = 0; w < 2; w++)
+        for (int p = 0; p < 3; p++) {
+            access_pattern pattern = {region, region_bytes / sizeof(int), 0, steps[p], 1, w == 1};
+            bench(w ? "put_val" : "get_val", pattern_name[p], access_ints, &pattern, 1000, measured_samples);
+        }
+    bench("vm_pin_unpin", "4096B", pin_unpin, region, 100, measured_samples);
+    void *direct;
+    vm_pinned *pin = vm_pin(region, region_bytes, &direct);
+    if (direct != NULL) {
+        access_pattern pattern = {direct, region_bytes / sizeof(int), 0, 1, 1, false};
+        bench("pinned_read", "sequential", pinned_ints, &pattern, 1000, measured_samples);
+    }
+    vm_unpin(pin);
+
+    int mat_sizes[] = {16, 64, 128};
+    for (int s = 0; s < 3; s++) {
+        int n = mat_sizes[s];
+        matrices m = {umalloc(n * n * sizeof(int)), umalloc(n * n * sizeof(int)), umalloc(n * n * sizeof(int)), n};
+        for (int k = 0; k < n * n; k++) {
+            int x = k % 7, y = k % 5;
+            put_val((char *)m.a + k * sizeof(int), &x, sizeof(int));
+            put_val((char *)m.b + k * sizeof(int), &y, sizeof(int));
+        }
+        snprintf(param, sizeof(param), "%dx%d", n, n);
+        bench("mat_mult", param, multiply, &m, 1, n >= 128 ? 20 : 100);
+        ufree(m.a, n * n * sizeof(int));
+        ufree(m.b, n * n * sizeof(int));
+        ufree(m.c, n * n * sizeof(int));
+    }
+    ufree(region, region_bytes);
+    if (csv != stdout)
+        fclose(csv);
+    return 0;
+}
@@ -0,0 +1,85 @@
+#include "../my_vm.h"
+#include <time.h>
+
+// native mode: the same random int reads and writes through the pointers umalloc() returns and
+// through get_val/put_val, with the host faults that backed them. The working set is given in
+// MB, one larger than MAX_MEMSIZE needs the swap file the second argument turns on.
+//   ./native_test [working set MB] [swap]
+#define default_mb 256
+#define accesses 4000000
+#define swap_path "native_test.swap"
+
+double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    uint64_t bytes = (uint64_t)(argc > 1 ? atoi(argv[1]) : default_mb) << 20, ints = bytes / sizeof(int);
+    set_native_mode(true);
+    if (argc > 2 && !set_swap_file(swap_path)) {
+        fprintf(stderr, "cannot open %s\n", swap_path);
+        return 1;
+    }
+    int *base = umalloc(bytes);
+    if (base == NULL) {
+        fprintf(stderr, "umalloc(%" PRIu64 ") fails\n", bytes);
+        return 1;
+    }
+    // every page holds its index, written through the pointer
+    vm_counters before, after;
+    vm_stats(&before);
+    double start = now();
+    for (uint64_t page = 0; page < bytes / PGSIZE; page++)
+        base[page * (PGSIZE / sizeof(int))] = page;
+    double fill = now() - start;
+    vm_stats(&after);
+    printf("fill %" PRIu64 " MB: %.3f s, %" PRIu64 " native faults\n", bytes >> 20, fill,
+           after.native_faults - before.native_faults);
+
+    printf("access  ops/sec     native_faults swap_ins\n");
+    for (int native = 1; native >= 0; native--) {
+        unsigned int seed = 1;
+        uint64_t errors = 0;
+        vm_stats(&before);
+        start = now();
+        for (int i = 0; i < accesses; i++) {
+            uint64_t page = ((uint64_t)rand_r(&seed) << 16 ^ rand_r(&seed)) % (bytes / PGSIZE);
+            int *p = base + page * (PGSIZE / sizeof(int)), value;
+            if (native)
+                value = *p;
+            else
+                get_val(p, &value, sizeof(int));
+            if (value != (int)page)
+                errors++;
+            value = i;
+            if (native)
+                p[1] = value;
+            else
+                put_val(p + 1, &value, sizeof(int));
+        }
+        double seconds = now() - start;
+        vm_stats(&after);
+        printf("%-7s %-11.0f %-13" PRIu64 " %" PRIu64 "\n", native ? "native" : "get_put", accesses / seconds,
+               after.native_faults - before.native_faults, after.swap_ins - before.swap_ins);
+        if (errors > 0) {
+            printf("%" PRIu64 " pages read back wrong\n", errors);
+            return 1;
+        }
+    }
+    // native memory as the host buffer of get_val/put_val, on pages not mapped yet
+    uint64_t len = 64 * PGSIZE;
+    char *buf = umalloc(len);
+    get_val(base, buf, len);
+    put_val((char *)base + len, buf, len);
+    if (memcmp(buf, base, len) != 0 || memcmp((char *)base + len, base, len) != 0) {
+        printf("copy through a native buffer wrong\n");
+        return 1;
+    }
+    ufree(buf, len);
+    ufree(base, bytes);
+    if (argc > 2)
+        unlink(swap_path);
+    return 0;
+}
@@ -0,0 +1,50 @@
+#include "../my_vm.h"
+#include <time.h>
+
+// umalloc/put_val/ufree throughput of small allocations from 1 to max_threads threads
+#define max_threads 64
+#define ops_per_thread 20000
+#define live_per_thread 16
+
+pthread_t threads[max_threads];
+int ids[max_threads];
+
+void *churn(void *id_arg) {
+    int id = *((int *)id_arg);
+    void *live[live_per_thread] = {NULL};
+    uint64_t sizes[live_per_thread] = {0};
+    unsigned int seed = id + 1;
+    for (int i = 0; i < ops_per_thread; i++) {
+        int slot = rand_r(&seed) % live_per_thread;
+        if (live[slot] != NULL)
+            ufree(live[slot], sizes[slot]);
+        sizes[slot] = 1 + rand_r(&seed) % (4 * PGSIZE);
+        live[slot] = umalloc(sizes[slot]);
+        put_val(live[slot], &id, sizeof(int));
+    }
+    for (int slot = 0; slot < live_per_thread; slot++)
+        if (live[slot] != NULL)
+            ufree(live[slot], sizes[slot]);
+    return NULL;
+}
+
+int main() {
+    struct timespec start, end;
+    for (int i = 0; i < max_threads; i++)
+        ids[i] = i;
+    // initialize the library outside of the measurement
+    ufree(umalloc(1), 1);
+
+    printf("threads ops/sec\n");
+    for (int num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < num_threads; i++)
+            pthread_create(&threads[i], NULL, churn, (void *)&ids[i]);
+        for (int i = 0; i < num_threads; i++)
+            pthread_join(threads[i], NULL);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("%7d %.0f\n", num_threads, (double)num_threads * ops_per_thread / seconds);
+    }
+    return 0;
+}
@@ -0,0 +1,217 @@
+#include "../my_vm.h"
+#include <time.h>
+
+// throughput, tail latency and lock waits of the thread safe API as threads are added, for several
+// operation mixes. Every thread owns a region and a set of allocations that carry checksums, all reads
+// are checked against what the thread wrote, so races that lose or mix up data fail the run.
+//   ./stress_test [ops per thread] [max threads]
+#define default_ops 20000
+#define default_max_threads 32
+#define region_ints (16 * PGSIZE / sizeof(int))
+#define live_allocs 8
+#define mat_size 8
+
+// percent of the operations of each kind, the rest are p_mat_mult calls
+typedef struct op_mix {
+    const char *name;
+    int get, put, alloc, free;
+} op_mix;
+
+op_mix mixes[] = {
+    {"read", 90, 10, 0, 0},
+    {"write", 10, 90, 0, 0},
+    {"alloc", 10, 10, 40, 40},
+    {"mixed", 35, 35, 14, 14},
+    {"matmult", 40, 40, 0, 0},
+};
+#define num_mixes (sizeof(mixes) / sizeof(mixes[0]))
+
+typedef struct allocation {
+    int *va;
+    int ints;
+    uint32_t checksum;
+} allocation;
+
+typedef struct worker {
+    int id;
+    int ops;
+    op_mix *mix;
+    int *region;
+    int *shadow;  // what the region should hold
+    allocation live[live_allocs];
+    void *mat[3];
+    double *latency;
+    uint64_t errors;
+    pthread_t thread;
+} worker;
+
+double now_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+uint32_t checksum(int *ints, int n) {
+    uint32_t sum = 2166136261u;
+    for (int i = 0; i < n; i++)
+        sum = (sum ^ (uint32_t)ints[i]) * 16777619u;
+    return sum;
+}
+
+// fills a new allocation with values only this thread and op produce and records their checksum
+void fill(worker *w, allocation *a, int ints, unsigned int *seed) {
+    int *buf = malloc(ints * sizeof(int));
+    for (int i = 0; i < ints; i++)
+        buf[i] = w->id << 24 ^ rand_r(seed);
+    a->va = umalloc(ints * sizeof(int));
+    if (a->va == NULL) {
+        fprintf(stderr, "thread %d: umalloc(%zu) fails\n", w->id, ints * sizeof(int));
+        exit(1);
+    }
+    a->ints = ints;
+    a->checksum = checksum(buf, ints);
+    put_val(a->va, buf, ints * sizeof(int));
+    free(buf);
+}
+
+// reads an allocation back, checks it and frees it
+void release(worker *w, allocation *a) {
+    int *buf = malloc(a->ints * sizeof(int));
+    get_val(a->va, buf, a->ints * sizeof(int));
+    if (checksum(buf, a->ints) != a->checksum) {
+        fprintf(stderr, "thread %d: allocation at %p corrupted\n", w->id, (void *)a->va);
+        w->errors++;
+    }
+    ufree(a->va, a->ints * sizeof(int));
+    a->va = NULL;
+    free(buf);
+}
+
+// multiplies the thread's matrices and checks the answer against a plain multiplication
+void multiply(worker *w) {
+    int a[mat_size * mat_size], b[mat_size * mat_size], c[mat_size * mat_size];
+    p_mat_mult(w->mat[0], w->mat[1], mat_size, w->mat[2]);
+    get_val(w->mat[0], a, sizeof(a));
+    get_val(w->mat[1], b, sizeof(b));
+    get_val(w->mat[2], c, sizeof(c));
+    for (int i = 0; i < mat_size; i++)
+        for (int j = 0; j < mat_size; j++) {
+            int sum = 0;
+            for (int k = 0; k < mat_size; k++)
+                sum += a[i * mat_size + k] * b[k * mat_size + j];
+            if (c[i * mat_size + j] != sum) {
+                fprintf(stderr, "thread %d: p_mat_mult answer wrong at %d,%d\n", w->id, i, j);
+                w->errors++;
+                return;
+            }
+        }
+}
+
+void *run(void *arg) {
+    worker *w = arg;
+    unsigned int seed = w->id + 1;
+    for (int i = 0; i < w->ops; i++) {
+        int kind = rand_r(&seed) % 100;
+        double start = now_ns();
+        if ((kind -= w->mix->get) < 0) {
+            int index = rand_r(&seed) % region_ints, value;
+            get_val(w->region + index, &value, sizeof(int));
+            if (value != w->shadow[index]) {
+                fprintf(stderr, "thread %d: region[%d] holds %d, wrote %d\n", w->id, index, value, w->shadow[index]);
+                w->errors++;
+            }
+        } else if ((kind -= w->mix->put) < 0) {
+            int index = rand_r(&seed) % region_ints;
+            w->shadow[index] = w->id << 24 ^ i;
+            put_val(w->region + index, &w->shadow[index], sizeof(int));
+        } else if ((kind -= w->mix->alloc) < 0) {
+            allocation *a = &w->live[rand_r(&seed) % live_allocs];
+            if (a->va != NULL)
+                release(w, a);
+            fill(w, a, 1 + rand_r(&seed) % (2 * PGSIZE), &seed);
+        } else if ((kind -= w->mix->free) < 0) {
+            allocation *a = &w->live[rand_r(&seed) % live_allocs];
+            if (a->va != NULL)
+                release(w, a);
+        } else
+            multiply(w);
+        w->latency[i] = now_ns() - start;
+    }
+    // the whole region has to match what the thread wrote to it
+    int *buf = malloc(region_ints * sizeof(int));
+    get_val(w->region, buf, region_ints * sizeof(int));
+    if (checksum(buf, region_ints) != checksum(w->shadow, region_ints)) {
+        fprintf(stderr, "thread %d: region checksum mismatch\n", w->id);
+        w->errors++;
+    }
+    free(buf);
+    for (int k = 0; k < live_allocs; k++)
+        if (w->live[k].va != NULL)
+            release(w, &w->live[k]);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    int ops = argc > 1 ? atoi(argv[1]) : default_ops;
+    int max_threads = argc > 2 ? atoi(argv[2]) : default_max_threads;
+    worker *workers = calloc(max_threads, sizeof(worker));
+    double *latency = malloc((size_t)max_threads * ops * sizeof(double));
+    uint64_t errors = 0;
+
+    // regions and matrices live for the whole run, the sweep only measures the operations
+    for (int t = 0; t < max_threads; t++) {
+        worker *w = &workers[t];
+        w->id = t;
+        w->ops = ops;
+        w->latency = latency + (size_t)t * ops;
+        w->region = umalloc(region_ints * sizeof(int));
+        w->shadow = calloc(region_ints, sizeof(int));
+        put_val(w->region, w->shadow, region_ints * sizeof(int));
+        for (int m = 0; m < 3; m++) {
+            int init[mat_size * mat_size];
+            for (int k = 0; k < mat_size * mat_size; k++)
+                init[k] = (t + m + k) % 9 - 4;
+            w->mat[m] = umalloc(sizeof(init));
+            put_val(w->mat[m], init, sizeof(init));
+        }
+    }
+
+    printf("mix     threads ops/sec     p50_ns  p99_ns  p999_ns max_us  pt_waits pt_wait_ms tlb_waits tlb_wait_ms\n");
+    for (int m = 0; m < num_mixes; m++) {
+        for (int threads = 1; threads <= max_threads; threads *= 2) {
+            vm_counters before, after;
+            vm_stats(&before);
+            double start = now_ns();
+            for (int t = 0; t < threads; t++) {
+                workers[t].mix = &mixes[m];
+                pthread_create(&workers[t].thread, NULL, run, &workers[t]);
+            }
+            for (int t = 0; t < threads; t++)
+                pthread_join(workers[t].thread, NULL);
+            double seconds = (now_ns() - start) / 1e9;
+            vm_stats(&after);
+
+            uint64_t n = (uint64_t)threads * ops;
+            qsort(latency, n, sizeof(double), compare_double);
+            printf("%-7s %7d %-11.0f %-7.0f %-7.0f %-7.0f %-6.0f %-8" PRIu64 " %-10.2f %-9" PRIu64 " %.2f\n", mixes[m].name,
+                   threads, n / seconds, latency[n / 2], latency[n * 99 / 100], latency[n * 999 / 1000],
+                   latency[n - 1] / 1e3, after.pt_lock_waits - before.pt_lock_waits,
+                   (after.pt_lock_wait_ns - before.pt_lock_wait_ns) / 1e6, after.tlb_lock_waits - before.tlb_lock_waits,
+                   (after.tlb_lock_wait_ns - before.tlb_lock_wait_ns) / 1e6);
+            fflush(stdout);
+        }
+    }
+    for (int t = 0; t < max_threads; t++)
+        errors += workers[t].errors;
+    if (errors > 0) {
+        printf("integrity check failed: %" PRIu64 " errors\n", errors);
+        return 1;
+    }
+    printf("integrity check passed\n");
+    return 0;
+}
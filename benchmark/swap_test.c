@@ -0,0 +1,71 @@
+#include "../my_vm.h"
+#include <time.h>
+
+// fault rate and throughput of random page accesses as the working set grows past MAX_MEMSIZE,
+// uniform over the working set and skewed to a hot tenth of it. A second argument puts a
+// compressed tier of that many MB in front of the swap file.
+#define default_accesses 1000000
+#define swap_path "swap_test.swap"
+
+double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// accesses random pages of the working set, every page holds its own index
+double run(char *base, uint64_t pages, int accesses, bool skewed, uint64_t *faults) {
+    unsigned int seed = 1;
+    uint64_t before, after;
+    swap_stats(&before, NULL);
+    double start = now();
+    for (int i = 0; i < accesses; i++) {
+        uint64_t page = ((uint64_t)rand_r(&seed) << 16 ^ rand_r(&seed)) % pages;
+        if (skewed && rand_r(&seed) % 10 != 0)
+            page %= pages / 10;
+        uint64_t value;
+        get_val(base + page * PGSIZE, &value, sizeof(value));
+        if (value != page) {
+            fprintf(stderr, "page %" PRIu64 " holds %" PRIu64 "\n", page, value);
+            exit(1);
+        }
+    }
+    double seconds = now() - start;
+    swap_stats(&after, NULL);
+    *faults = after - before;
+    return accesses / seconds;
+}
+
+int main(int argc, char **argv) {
+    int accesses = argc > 1 ? atoi(argv[1]) : default_accesses;
+    if (!set_swap_file(swap_path)) {
+        fprintf(stderr, "cannot open %s\n", swap_path);
+        return 1;
+    }
+    if (argc > 2)
+        set_swap_compress((uint64_t)atoi(argv[2]) << 20);
+    printf("ws_MB uniform_faults/access uniform_accesses/sec skewed_faults/access skewed_accesses/sec\n");
+    for (int eighths = 4; eighths <= 16; eighths += 2) {
+        uint64_t bytes = (uint64_t)MAX_MEMSIZE / 8 * eighths, pages = bytes / PGSIZE;
+        char *base = umalloc(bytes);
+        if (base == NULL) {
+            fprintf(stderr, "umalloc(%" PRIu64 ") fails\n", bytes);
+            return 1;
+        }
+        for (uint64_t page = 0; page < pages; page++)
+            put_val(base + page * PGSIZE, &page, sizeof(page));
+        uint64_t uniform, skewed;
+        double uniform_rate = run(base, pages, accesses, false, &uniform);
+        double skewed_rate = run(base, pages, accesses, true, &skewed);
+        printf("%5" PRIu64 " %.4f %.0f %.4f %.0f\n", bytes >> 20, (double)uniform / accesses, uniform_rate,
+               (double)skewed / accesses, skewed_rate);
+        ufree(base, bytes);
+    }
+    unlink(swap_path);
+    vm_zstats z;
+    zswap_stats(&z);
+    if (z.stored > 0)
+        printf("compressed %" PRIu64 " pages (%" PRIu64 " rejected) ratio %.1f, %" PRIu64 " decompressions %.0f ns each\n",
+               z.stored, z.rejected, (double)z.bytes_in / z.bytes_out, z.faults, (double)z.fault_ns / z.faults);
+    return 0;
+}
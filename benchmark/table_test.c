@@ -0,0 +1,112 @@
+#include "../my_vm.h"
+#include <sys/wait.h>
+
+// eager allocations that need more page tables than the startup reserve holds, once through
+// many small allocations and once through many address spaces, and running out of memory
+// while other threads hold frames in their caches. Each case runs in a child of its own, so
+// it starts with a fresh reserve, and fails when it does not finish in time.
+#define time_limit 60
+#define contexts 128
+#define cache_threads 16
+#define block (16 * PGSIZE)
+
+// 16 pages at a time until physical memory is full, every allocation takes the locked path
+int exhaust() {
+    set_huge_mappings(false);
+    uint64_t n = 0;
+    while (umalloc(16 * PGSIZE) != NULL)
+        n++;
+    printf("%" PRIu64 " allocations of 16 pages\n", n);
+    return n > 0 ? 0 : 1;
+}
+
+// a pgd and a first allocation in every context
+int many_contexts() {
+    vm_context *ctx[contexts];
+    for (int i = 0; i < contexts; i++) {
+        ctx[i] = vm_context_create();
+        if (ctx[i] == NULL) {
+            fprintf(stderr, "vm_context_create %d fails\n", i);
+            return 1;
+        }
+        vm_switch(ctx[i]);
+        int value = i, back = -1;
+        void *p = umalloc(40000);
+        put_val(p, &value, sizeof(int));
+        get_val(p, &back, sizeof(int));
+        vm_switch(NULL);
+        if (back != i) {
+            fprintf(stderr, "context %d reads back %d\n", i, back);
+            return 1;
+        }
+    }
+    for (int i = 0; i < contexts; i++)
+        vm_context_destroy(ctx[i]);
+    printf("%d contexts\n", contexts);
+    return 0;
+}
+
+// blocks of 16 pages until physical memory is full, then all of them are freed again
+uint64_t fill() {
+    static void *blocks[MAX_MEMSIZE / block];
+    uint64_t n = 0;
+    while (n < MAX_MEMSIZE / block && (blocks[n] = umalloc(block)) != NULL)
+        n++;
+    for (uint64_t k = 0; k < n; k++)
+        ufree(blocks[k], block);
+    return n;
+}
+
+pthread_barrier_t parked, resume;
+
+// leave frames in the thread's cache and keep it alive until the main thread is done
+void *park(void *arg) {
+    void *pages[8];
+    for (int i = 0; i < 8; i++)
+        pages[i] = umalloc(PGSIZE);
+    for (int i = 0; i < 8; i++)
+        ufree(pages[i], PGSIZE);
+    pthread_barrier_wait(&parked);
+    pthread_barrier_wait(&resume);
+    return NULL;
+}
+
+// the frames cached by parked threads still count when memory runs out
+int cached_frames() {
+    set_huge_mappings(false);
+    uint64_t before = fill();
+    pthread_t threads[cache_threads];
+    pthread_barrier_init(&parked, NULL, cache_threads + 1);
+    pthread_barrier_init(&resume, NULL, cache_threads + 1);
+    for (int i = 0; i < cache_threads; i++)
+        pthread_create(&threads[i], NULL, park, NULL);
+    pthread_barrier_wait(&parked);
+    uint64_t after = fill();
+    pthread_barrier_wait(&resume);
+    for (int i = 0; i < cache_threads; i++)
+        pthread_join(threads[i], NULL);
+    printf("%" PRIu64 " blocks, %" PRIu64 " with %d threads parked\n", before, after, cache_threads);
+    // the page tables of the threads may take a block
+    return after + 1 >= before ? 0 : 1;
+}
+
+int run(const char *name, int (*test)()) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        alarm(time_limit);
+        exit(test());
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        return 0;
+    printf("%s fails%s\n", name, WIFSIGNALED(status) && WTERMSIG(status) == SIGALRM ? ": hangs" : "");
+    return 1;
+}
+
+int main() {
+    int failed = run("exhaust", exhaust) + run("many_contexts", many_contexts) + run("cached_frames", cached_frames);
+    printf(failed ? "table test failed\n" : "table test passed\n");
+    return failed != 0;
+}
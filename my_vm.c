@@ -1,39 +1,184 @@
 #include "my_vm.h"
 
+char *memstart;
+uint32_t *pbitmap;		// frames out of the buddy allocator: mapped, page tables or cached
+uint32_t *vbitmap;		// vbitmap of the default context
+uint64_t _pagenum;
+uint32_t _offsetbits;
+uint32_t _tablesize;
+uint32_t _tlbmodbits;
+pthread_rwlock_t _pagetable_lock;
+pthread_rwlock_t _tlb_lock[TLBSIZE];
+pthread_rwlock_t _tlb_hugelock;
+tlb_cache _tlb_shared;
+uint32_t _tlbways;
+uint32_t _tlbsets;
+tlb_policy _tlbpolicy;
+tlb_mode _tlbmode;
+
 pthread_mutex_t _init_mutex = PTHREAD_MUTEX_INITIALIZER;
 bool _init_physical = false;
-pgd_t *_pgd = NULL;
+uint64_t _vpagenum;
+alloc_mode _allocmode = ALLOC_EAGER;
+bool _mem_thp = false;
+// eager allocations of at least HUGE_PAGES pages are mapped with 2 MiB pmd entries where possible
+bool _hugemap = true;
+uint64_t _huge_mapped = 0;		// live huge mappings, the huge TLB is only searched when there are any
+
+// TLB organization requested through set_tlb_config(), applied by tlb_init()
+uint32_t _tlbconf_ways = TLBWAYS;
+tlb_policy _tlbconf_policy = TLB_LRU;
+tlb_mode _tlbconf_mode = TLB_SHARED;
+
+// TLB_THREAD mode: every private TLB is linked on _tlb_threads, counts of exited threads go to _tlb_retired_*
+__thread tlb_cache *_tlb_local = NULL;
+tlb_cache *_tlb_threads = NULL;
+pthread_mutex_t _tlb_threads_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t _tlb_key;
+pthread_once_t _tlb_key_once = PTHREAD_ONCE_INIT;
+uint64_t _tlb_retired_hits = 0;
+uint64_t _tlb_retired_misses = 0;
+// epoch based reclamation of page tables unlinked while lock free walkers may still read them
+__thread ebr_thread *_ebr_local = NULL;
+ebr_thread *_ebr_threads = NULL;
+pthread_mutex_t _ebr_threads_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t _ebr_key;
+pthread_once_t _ebr_key_once = PTHREAD_ONCE_INIT;
+uint64_t _ebr_epoch = 1;
+ebr_limbo *_ebr_limbo = NULL;
+uint64_t _ebr_limbonum = 0;
+uint64_t _ebr_limbocap = 0;
+
+// buddy allocator over the frames of memstart: free blocks of 2^order frames are kept on
+// doubly linked lists threaded through _buddy_next/_buddy_prev, _buddy_order[ppn] is the
+// order of the free block starting at ppn or -1
+uint32_t _buddy_head[BUDDY_MAXORDER+1];
+uint32_t *_buddy_next = NULL;
+uint32_t *_buddy_prev = NULL;
+int8_t *_buddy_order = NULL;
+uint32_t _buddy_mask = 0;		// bit k set when the order k list is not empty
+uint32_t _buddy_toporder = 0;
+uint64_t _buddy_freeframes = 0;
+bool _buddy_release = false;	// hand merged blocks of BUDDY_RELEASE_ORDER back to the host
+// guards the buddy allocator, taken after _pagetable_lock when both are needed
+pthread_mutex_t _frame_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread frame_cache *_frame_local = NULL;
+// every thread's frame cache, so memory parked in them can be reclaimed
+frame_cache *_frame_caches = NULL;
+pthread_mutex_t _frame_caches_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t _frame_key;
+pthread_once_t _frame_key_once = PTHREAD_ONCE_INIT;
+// address spaces: _vm_contexts[asid] for the contexts alive, asid 0 is _vm_default. A thread
+// works in _vm_current, the default context while that is NULL
+vm_context _vm_default;
+vm_context *_vm_contexts[VM_MAXCONTEXTS] = {&_vm_default};
+__thread vm_context *_vm_current = NULL;
+pthread_mutex_t _vm_lock = PTHREAD_MUTEX_INITIALIZER;
+// p_mat_mult thread pool, started on first use: workers sleep on _pool_cond while no task
+// is queued, _pool_pending counts the queued tasks
+uint32_t _pool_size = 0;		// 0 until set_pool_size() or the first p_mat_mult
+uint32_t _pool_running = 0;		// workers started
+pthread_t _pool_threads[POOL_MAXTHREADS];
+pool_deque _pool_deque[POOL_MAXTHREADS];
+pthread_mutex_t _pool_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t _pool_cond = PTHREAD_COND_INITIALIZER;
+uint64_t _pool_pending = 0;
+bool _pool_stop = false;
+// page table pool, see table_pool_init()
+address_t *_table_free = NULL;
+uint64_t _table_freenum = 0;
+uint16_t *_table_live = NULL;
+// shootdown epoch, the vpn invalidated by shootdown e is kept in _tlb_shootlog[e % TLB_SHOOTDOWN_LOG]
+uint64_t _tlb_epoch = 0;
+pageno_t _tlb_shootlog[TLB_SHOOTDOWN_LOG];
+pthread_mutex_t _tlb_shoot_lock = PTHREAD_MUTEX_INITIALIZER;	// one writer of the log at a time
+// performance counters: a shard per thread on _stats_shards, see vm_stats(). The list only
+// grows, so the shards can be summed while threads come and go
+__thread stats_shard *_stats_local = NULL;
+stats_shard *_stats_shards = NULL;
+pthread_mutex_t _stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t _stats_key;
+pthread_once_t _stats_key_once = PTHREAD_ONCE_INIT;
+uint64_t _table_used = 0;		// page tables handed out by table_alloc() and not yet reclaimed
+// set_stats_dump(): the signal handler wakes the dump thread through _stats_sem
+char *_stats_path = NULL;
+sem_t _stats_sem;
+bool _stats_atexit = false;
+bool _stats_thread = false;
+// extra mappings of a frame shared by vm_clone(), 0 for a frame mapped once
+uint32_t *_frame_ref = NULL;
+// vm_pin() count of a frame, with FRAME_PIN_FREED once its page was freed while pinned
+uint32_t *_frame_pin = NULL;
+// swap mode, see set_swap_file(): _frame_vpn maps a frame back to the 4K page it backs, the
+// CLOCK hand of swap_evict() sweeps it, _swap_slots has a bit per used slot of the swap file
+bool _swapon = false;
+int _swapfd = -1;
+uint32_t *_swap_slots = NULL;
+pageno_t *_frame_vpn = NULL;
+pageno_t _swap_hand = 0;
+uint64_t _swap_ins = 0;
+uint64_t _swap_outs = 0;
+// compressed tier, see set_swap_compress(): _zswap_data[slot] is the compressed page of a
+// pte with PTE_COMPRESSED, _zswap_bytes of them are held against a budget of _zswap_max
+uint8_t **_zswap_data = NULL;
+uint64_t _zswap_max = 0;
+uint64_t _zswap_bytes = 0;
+vm_zstats _zswap_stats;
+// native mode, see set_native_mode(): the default context is mirrored at _native_base, a page is
+// mapped there when the host faults on it. memstart is backed by _native_fd so that its frames
+// can be mapped twice, _native_ro has a bit per page mapped read only
+bool _native = false;
+char *_native_base = NULL;
+int _native_fd = -1;
+uint32_t *_native_ro = NULL;
+struct sigaction _native_prev;
+// the process keeps below _native_maxmaps host mappings: /proc/self/maps is counted again
+// once _native_ops mmap calls into the region have used up the _native_slack left
+uint64_t _native_maxmaps = 0;
+uint64_t _native_ops = 0;
+uint64_t _native_slack = 0;
 
 void set_physical_mem() {
     //Allocate physical memory using mmap or malloc; this is the total size of your memory you are simulating
-	if(posix_memalign(&memstart, PGSIZE, MAX_MEMSIZE) != 0) {
-		fprintf(stderr, "posix_memalign error!\n");
+	// only reserve the address range: the host commits (zeroed) pages as they are first touched
+	char *reserved = mmap(NULL, MAX_MEMSIZE+MEM_ALIGN, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if(reserved == MAP_FAILED) {
+		fprintf(stderr, "mmap for physical memory fails!\n");
 		exit(1);
 	}
-	memset(memstart, 0, MAX_MEMSIZE);
+	// align memstart so that transparent huge pages can back whole 2 MiB blocks of frames
+	memstart = (char*)(((address_t)reserved+MEM_ALIGN-1) & ~(address_t)(MEM_ALIGN-1));
+	if(memstart != reserved)	munmap(reserved, memstart-reserved);
+	munmap(memstart+MAX_MEMSIZE, reserved+MEM_ALIGN-memstart);
+	if(_native)	native_init();
+	if(_mem_thp)	madvise(memstart, MAX_MEMSIZE, MADV_HUGEPAGE);
 	_offsetbits = get_pow2(PGSIZE);
 	_pagenum = MAX_MEMSIZE/PGSIZE;
+	_vpagenum = MAX_VIRTSIZE/PGSIZE;
 	_tablesize = 1<<LEVELBITS;
-	_tlbmodbits = ~((~0)<<get_pow2(TLBSIZE));
-	uint64_t bitmapsize = _pagenum/8;  // the size of bitmap, in terms of byte
     //HINT: Also calculate the number of physical and virtual pages and allocate virtual and physical bitmaps and initialize them
-	pbitmap = (uint32_t*)calloc(bitmapsize, 1);
-	if(pbitmap == NULL) {
-		fprintf(stderr, "calloc for pbitmap fails!\n");
+	pbitmap = bitmap_create(_pagenum);
+	buddy_init();
+	table_pool_init();
+	_frame_vpn = (pageno_t*)malloc(_pagenum*sizeof(pageno_t));
+	if(_frame_vpn == NULL) {
+		fprintf(stderr, "malloc for _frame_vpn fails!\n");
 		exit(1);
 	}
-	vbitmap = (uint32_t*)calloc(bitmapsize, 1);
-	if(vbitmap == NULL) {
-		fprintf(stderr, "calloc for vbitmap fails!\n");
+	memset(_frame_vpn, 0xff, _pagenum*sizeof(pageno_t));
+	_frame_ref = (uint32_t*)calloc(_pagenum, sizeof(uint32_t));
+	_frame_pin = (uint32_t*)calloc(_pagenum, sizeof(uint32_t));
+	if(_frame_ref==NULL || _frame_pin==NULL) {
+		fprintf(stderr, "calloc for _frame_ref fails!\n");
 		exit(1);
 	}
-	_pgd = (pgd_t*)calloc(_tablesize, sizeof(address_t));
-	if(_pgd == NULL) {
-		fprintf(stderr, "calloc for _pgd fails!\n");
+	if(vm_context_init(&_vm_default) == false) {
+		fprintf(stderr, "pgd for the default context fails!\n");
 		exit(1);
 	}
+	vbitmap = _vm_default.vbitmap;
 
-	for(int i=0;i<TLBSIZE;++i)	_tlb_store[i].valid = false;
+	tlb_init();
 
 	if(0 != pthread_rwlock_init(&_pagetable_lock, NULL)) {
 		fprintf(stderr, "init pagetable lock fails!\n");
@@ -45,96 +190,335 @@ void set_physical_mem() {
 			exit(1);
 		}
 	}
+	if(0 != pthread_rwlock_init(&_tlb_hugelock, NULL)) {
+		fprintf(stderr, "init tlb hugelock fails!\n");
+		exit(1);
+	}
 
 	_init_physical = true;
 }
 
-/*The function takes a virtual address and performs translation to return the physical address*/
-address_t translate(address_t va) {
-	if(_pgd == NULL) {
-		fprintf(stderr, "Error! function[%s] line[%d]\n", __func__, __LINE__);
-		return 0;
+// an empty address space: vbitmap, slab directory and a pgd taken from the table pool, false without a pgd
+bool vm_context_init(vm_context *ctx) {
+	ctx->vbitmap = bitmap_create(_vpagenum);
+	// vpn 0 is never handed out, so no allocation can be mistaken for NULL
+	set_bitmap(ctx->vbitmap, 0);
+	ctx->slab_dir = (slab***)calloc((_vpagenum>>LEVELBITS)+1, sizeof(slab**));
+	if(ctx->slab_dir == NULL) {
+		fprintf(stderr, "calloc for slab directory fails!\n");
+		exit(1);
 	}
+	for(int i=0;i<SLAB_CLASSES;++i) {
+		ctx->slab_partial[i] = NULL;
+		pthread_mutex_init(&ctx->slab_lock[i], NULL);
+	}
+	ctx->pgd = (pgd_t*)table_alloc();
+	return ctx->pgd != NULL;
+}
 
-	pageno_t vpn = va>>_offsetbits;
-	pageno_t tlb_pfn = tlb_lookup(vpn);
-	if(tlb_pfn != 0)	return (tlb_pfn<<_offsetbits) | get_pageoffset(va);
+/* A new address space with the next free asid, sharing the frames of memstart with every
+ * other context. NULL when VM_MAXCONTEXTS contexts are alive or no frame is left for its pgd. */
+vm_context *vm_context_create() {
+	pthread_mutex_lock(&_init_mutex);
+	if(_init_physical == false)	set_physical_mem();
+	pthread_mutex_unlock(&_init_mutex);
 
-	uint32_t pgdindex = get_pgdindex(va);
-	if(_pgd[pgdindex] == 0)	{
-		fprintf(stderr, "Error! function[%s] line[%d]\n", __func__, __LINE__);
-		return 0;
+	vm_context *ctx = (vm_context*)calloc(1, sizeof(vm_context));
+	if(ctx == NULL) {
+		fprintf(stderr, "calloc for vm_context fails!\n");
+		exit(1);
 	}
-
-	pud_t *pudtable = _pgd[pgdindex];
-	uint32_t pudindex = get_pudindex(va);
-	if(pudtable[pudindex] == 0)	{
-		fprintf(stderr, "Error! function[%s] line[%d]\n", __func__, __LINE__);
-		return 0;
+	pthread_mutex_lock(&_vm_lock);
+	uint32_t asid = 1;
+	while(asid<VM_MAXCONTEXTS && _vm_contexts[asid]!=NULL)	++asid;
+	if(asid == VM_MAXCONTEXTS) {
+		pthread_mutex_unlock(&_vm_lock);
+		free(ctx);
+		return NULL;
+	}
+	ctx->asid = asid;
+	// the table pool is only used with _pagetable_lock held for writing
+	hold_wlock(&_pagetable_lock);
+	bool ready = vm_context_init(ctx);
+	release_lock(&_pagetable_lock);
+	if(ready == false) {
+		pthread_mutex_unlock(&_vm_lock);
+		for(int i=0;i<SLAB_CLASSES;++i)	pthread_mutex_destroy(&ctx->slab_lock[i]);
+		bitmap_destroy(ctx->vbitmap);
+		free(ctx->slab_dir);
+		free(ctx);
+		return NULL;
 	}
+	__atomic_store_n(&_vm_contexts[asid], ctx, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&_vm_lock);
+	return ctx;
+}
 
-	pmd_t *pmdtable = pudtable[pudindex];
-	uint32_t pmdindex = get_pmdindex(va);
-	if(pmdtable[pmdindex] == 0)	{
-		fprintf(stderr, "Error! function[%s] line[%d]\n", __func__, __LINE__);
-		return 0;
+/* Free every page of ctx, its tables and the context. No other thread may still work in
+ * ctx; the calling thread is back in its previous context afterwards, or in the default
+ * one if that was ctx. The asid is reused only after all its TLB entries were shot down
+ * with the pages they translated. */
+void vm_context_destroy(vm_context *ctx) {
+	if(ctx==NULL || ctx==&_vm_default)	return;
+	vm_context *prev = vm_switch(ctx);
+	for(pageno_t chunk=0;chunk<=(_vpagenum>>LEVELBITS);++chunk) {
+		if(ctx->slab_dir[chunk] == NULL)	continue;
+		for(uint32_t k=0;k<_tablesize;++k)	free(ctx->slab_dir[chunk][k]);
+		free(ctx->slab_dir[chunk]);
 	}
+	hold_wlock(&_pagetable_lock);
+	// slab pages go with the allocations, every run of reserved pages is unmapped at once
+	for(pageno_t vpn=bitmap_next_set(ctx->vbitmap, 1);vpn<_vpagenum;) {
+		pageno_t end = bitmap_next_clear(ctx->vbitmap, vpn);
+		if(end == BITMAP_NOTFOUND)	end = _vpagenum;
+		unmap_pages(vpn, end-vpn);
+		vpn = bitmap_next_set(ctx->vbitmap, end);
+	}
+	table_retire((address_t*)ctx->pgd);
+	ebr_reclaim();
+	release_lock(&_pagetable_lock);
+	vm_switch(prev==ctx ? NULL : prev);
+
+	pthread_mutex_lock(&_vm_lock);
+	_vm_contexts[ctx->asid] = NULL;
+	pthread_mutex_unlock(&_vm_lock);
+	for(int i=0;i<SLAB_CLASSES;++i)	pthread_mutex_destroy(&ctx->slab_lock[i]);
+	bitmap_destroy(ctx->vbitmap);
+	free(ctx->slab_dir);
+	free(ctx);
+}
 
-	pte_t *ptetable = pmdtable[pmdindex];
-	uint32_t pteindex = get_pteindex(va);
-	if(ptetable[pteindex] == 0)	{
+/* Make ctx the address space of the calling thread, NULL for the default one, and return
+ * the one it was working in. No TLB is flushed: entries of other contexts stay cached but
+ * carry another asid. */
+vm_context *vm_switch(vm_context *ctx) {
+	vm_context *prev = vm_current();
+	_vm_current = ctx;
+	return prev;
+}
+
+vm_context *vm_current() {
+	vm_context *ctx = _vm_current;
+	return ctx!=NULL ? ctx : &_vm_default;
+}
+
+// the key of vpn of ctx in the TLBs and _frame_vpn, the plain vpn in the default context
+pageno_t vm_tag(vm_context *ctx, pageno_t vpn) {
+	return vpn | (pageno_t)ctx->asid<<VM_ASID_SHIFT;
+}
+
+/*The function takes a virtual address and performs translation to return the physical address*/
+address_t translate(address_t va) {
+	if(vm_current()->pgd == NULL) {
 		fprintf(stderr, "Error! function[%s] line[%d]\n", __func__, __LINE__);
 		return 0;
 	}
-	pageno_t pfn = ptetable[pteindex];
-	tlb_add(vpn, pfn);
-	return (pfn<<_offsetbits) | get_pageoffset(va);
+	va = vm_address((void*)va);
+	address_t pa = translate_quiet(va, false, false);
+	// a swapped out page is read back first
+	if(pa==0 && page_swapped(va>>_offsetbits) && page_fault(va>>_offsetbits, false, false))	pa = translate_quiet(va, false, false);
+	if(pa == 0)	fprintf(stderr, "Error! function[%s] line[%d] va=%"PRIx64" is not mapped\n", __func__, __LINE__, va);
+	return pa;
 }
 
+/* Thread safe translation. The walk takes no page table lock: entries are read with acquire
+ * loads and tables unlinked by ufree are only reclaimed once every walker has left its
+ * ebr_enter()/ebr_exit() section, see ebr_retire(). */
 address_t p_translate(address_t va) {
-	if(_pgd == NULL) {
+	if(vm_current()->pgd == NULL) {
 		fprintf(stderr, "Error! function[%s] line[%d]\n", __func__, __LINE__);
 		return 0;
 	}
+	va = vm_address((void*)va);
+	address_t pa = translate_quiet(va, false, true);
+	if(pa==0 && page_swapped(va>>_offsetbits) && page_fault(va>>_offsetbits, false, true))	pa = translate_quiet(va, false, true);
+	if(pa == 0)	fprintf(stderr, "Error! function[%s] line[%d] va=%"PRIx64" is not mapped\n", __func__, __LINE__, va);
+	return pa;
+}
 
-	pageno_t vpn = va>>_offsetbits;
-	uint32_t tlbindex = vpn & _tlbmodbits;
-	hold_rlock(&_tlb_lock[tlbindex]);
-	pageno_t tlb_pfn = tlb_lookup(vpn);
-	release_lock(&_tlb_lock[tlbindex]);
-	if(tlb_pfn != 0)	return (tlb_pfn<<_offsetbits) | get_pageoffset(va);
-
-	uint32_t pgdindex = get_pgdindex(va);
-	if(_pgd[pgdindex] == 0)	{
-		fprintf(stderr, "Error! function[%s] line[%d]\n", __func__, __LINE__);
-		return 0;
+/* TLB lookup and page walk shared by translate() and p_translate(), returns 0 without a
+ * message when va has no frame, which is normal for a page of a lazy allocation or a page
+ * that was swapped out, and for a write to a page shared with a clone. The TLB keeps the
+ * PTE_READONLY bit of an entry next to its pfn, and is searched for the vpn tagged with the
+ * asid of the current context. */
+address_t translate_quiet(address_t va, bool write, bool threadsafe) {
+	VM_COUNT(translations, 1);
+	pageno_t vpn = va>>_offsetbits, tag = vm_tag(vm_current(), vpn);
+	uint32_t tlbindex = tlb_set(tag);
+	// a shootdown after this point keeps the walk result out of the TLB, see tlb_fill()
+	uint64_t epoch = __atomic_load_n(&_tlb_epoch, __ATOMIC_ACQUIRE);
+	pageno_t pfn;
+	bool huge = __atomic_load_n(&_huge_mapped, __ATOMIC_RELAXED) != 0;
+	// both page sizes are looked up, like a TLB probing its 4K and 2M entries in parallel
+	if(threadsafe && _tlbmode==TLB_SHARED) {
+		hold_rlock(&_tlb_lock[tlbindex]);
+		pfn = tlb_lookup(tag);
+		release_lock(&_tlb_lock[tlbindex]);
+		if(pfn==0 && huge) {
+			hold_rlock(&_tlb_hugelock);
+			pfn = tlb_lookup_huge(tag);
+			release_lock(&_tlb_hugelock);
+		}
+	}else {
+		pfn = tlb_lookup(tag);
+		if(pfn==0 && huge)	pfn = tlb_lookup_huge(tag);
 	}
-
-	pud_t *pudtable = _pgd[pgdindex];
-	uint32_t pudindex = get_pudindex(va);
-	if(pudtable[pudindex] == 0)	{
-		fprintf(stderr, "Error! function[%s] line[%d]\n", __func__, __LINE__);
-		return 0;
+	tlb_cache *cache = tlb_current();
+	tlb_count(pfn!=0 ? &cache->hits : &cache->misses);
+	if(pfn == 0) {
+		pfn = pt_walk(vpn, &huge);
+		if(pfn == 0)	return 0;
+		if(threadsafe)	tlb_fill(tag, pfn, epoch, huge);
+		else	tlb_add(tag, pfn, huge);
 	}
+	if(write && (pfn & PTE_READONLY))	return 0;
+	return ((pfn & PTE_PFNMASK)<<_offsetbits) | get_pageoffset(va);
+}
 
-	pmd_t *pmdtable = pudtable[pudindex];
-	uint32_t pmdindex = get_pmdindex(va);
-	if(pmdtable[pmdindex] == 0)	{
-		fprintf(stderr, "Error! function[%s] line[%d]\n", __func__, __LINE__);
-		return 0;
+/* The four level walk for vpn, 0 when some level is missing or the page is swapped out. The
+ * pfn of a page shared with a clone comes with PTE_READONLY. A huge pmd entry ends the walk
+ * one level early and sets *huge. */
+pageno_t pt_walk(pageno_t vpn, bool *huge) {
+	VM_COUNT(page_walks, 1);
+	address_t va = vpn<<_offsetbits;
+	pageno_t pfn = 0;
+	pgd_t *pgd = vm_current()->pgd;
+	if(huge != NULL)	*huge = false;
+	ebr_enter();
+	pud_t *pudtable = (pud_t*)__atomic_load_n(&pgd[get_pgdindex(va)], __ATOMIC_ACQUIRE);
+	if(pudtable == NULL)	goto out;
+	pmd_t *pmdtable = (pmd_t*)__atomic_load_n(&pudtable[get_pudindex(va)], __ATOMIC_ACQUIRE);
+	if(pmdtable == NULL)	goto out;
+	pmd_t pmd = __atomic_load_n(&pmdtable[get_pmdindex(va)], __ATOMIC_ACQUIRE);
+	if(pmd & PMD_HUGE) {
+		pfn = (pmd & ~PMD_HUGE) + (vpn & (HUGE_PAGES-1));
+		if(huge != NULL)	*huge = true;
+		goto out;
 	}
+	pte_t *ptetable = (pte_t*)pmd;
+	if(ptetable == NULL)	goto out;
+	pte_t entry = __atomic_load_n(&ptetable[get_pteindex(va)], __ATOMIC_ACQUIRE);
+	if(entry & PTE_SWAPPED)	goto out;
+	pte_accessed(&ptetable[get_pteindex(va)], entry);
+	pfn = entry & (PTE_PFNMASK|PTE_READONLY);
+out:
+	ebr_exit();
+	return pfn;
+}
 
-	pte_t *ptetable = pmdtable[pmdindex];
+/* Walk once for the run of pages from vpn that are mapped to consecutive frames, or that
+ * are all unbacked, looking at no more than maxpages pages and never past the end of the
+ * table reached. Returns the pfn of vpn (0 when unbacked), the length goes to *npages. A
+ * swapped out page is an unbacked run of its own, so is a page shared with a clone when
+ * the run is for a write. */
+pageno_t pt_walk_run(pageno_t vpn, uint64_t maxpages, bool write, uint64_t *npages) {
+	VM_COUNT(page_walks, 1);
+	address_t va = vpn<<_offsetbits;
+	pageno_t pfn = 0;
+	uint64_t span = 1ULL<<(3*LEVELBITS);	// pages covered by the entry that was missing
+	pgd_t *pgd = vm_current()->pgd;
+	ebr_enter();
+	pud_t *pudtable = (pud_t*)__atomic_load_n(&pgd[get_pgdindex(va)], __ATOMIC_ACQUIRE);
+	if(pudtable == NULL)	goto out;
+	span >>= LEVELBITS;
+	pmd_t *pmdtable = (pmd_t*)__atomic_load_n(&pudtable[get_pudindex(va)], __ATOMIC_ACQUIRE);
+	if(pmdtable == NULL)	goto out;
+	span >>= LEVELBITS;
+	pmd_t pmd = __atomic_load_n(&pmdtable[get_pmdindex(va)], __ATOMIC_ACQUIRE);
+	if(pmd & PMD_HUGE) {
+		pfn = (pmd & ~PMD_HUGE) + (vpn & (HUGE_PAGES-1));
+		goto out;
+	}
+	pte_t *ptetable = (pte_t*)pmd;
+	if(ptetable == NULL)	goto out;
 	uint32_t pteindex = get_pteindex(va);
-	if(ptetable[pteindex] == 0)	{
-		fprintf(stderr, "Error! function[%s] line[%d]\n", __func__, __LINE__);
-		return 0;
+	pte_t entry = __atomic_load_n(&ptetable[pteindex], __ATOMIC_ACQUIRE);
+	uint64_t count = 1;
+	if((entry & PTE_SWAPPED) || (write && (entry & PTE_READONLY)))	goto done;
+	pte_accessed(&ptetable[pteindex], entry);
+	pfn = entry & PTE_PFNMASK;
+	while(count<maxpages && pteindex+count<_tablesize) {
+		pte_t next = __atomic_load_n(&ptetable[pteindex+count], __ATOMIC_ACQUIRE);
+		if((next & PTE_SWAPPED) || (write && (next & PTE_READONLY)))	break;
+		if(pfn==0 ? next!=0 : (next & PTE_PFNMASK)!=pfn+count)	break;
+		pte_accessed(&ptetable[pteindex+count], next);
+		++count;
+	}
+done:
+	ebr_exit();
+	*npages = count;
+	return pfn;
+out:
+	ebr_exit();
+	*npages = span - (vpn&(span-1));
+	if(*npages > maxpages)	*npages = maxpages;
+	return pfn;
+}
+
+/* The pte of vpn in the page table of ctx, NULL when a level is missing or vpn is in a huge
+ * mapping. Lock free callers hold a read section. */
+pte_t *pte_lookup(vm_context *ctx, pageno_t vpn) {
+	address_t va = vpn<<_offsetbits;
+	pud_t *pudtable = (pud_t*)__atomic_load_n(&ctx->pgd[get_pgdindex(va)], __ATOMIC_ACQUIRE);
+	if(pudtable == NULL)	return NULL;
+	pmd_t *pmdtable = (pmd_t*)__atomic_load_n(&pudtable[get_pudindex(va)], __ATOMIC_ACQUIRE);
+	if(pmdtable == NULL)	return NULL;
+	pmd_t pmd = __atomic_load_n(&pmdtable[get_pmdindex(va)], __ATOMIC_ACQUIRE);
+	if(pmd==0 || (pmd & PMD_HUGE))	return NULL;
+	return &((pte_t*)pmd)[get_pteindex(va)];
+}
+
+// a walk read entry from *pte, set its accessed bit for the CLOCK hand in swap mode
+void pte_accessed(pte_t *pte, pte_t entry) {
+	if(!_swapon || entry==0 || (entry & PTE_ACCESSED))	return;
+	// an entry that changed meanwhile is left alone, it may have been cleared or swapped out
+	__atomic_compare_exchange_n(pte, &entry, entry|PTE_ACCESSED, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/* Translate [va, va+len) into at most maxruns runs of physically contiguous bytes, merging
+ * pages that sit in consecutive frames. Returns the number of runs, which cover a prefix of
+ * the range when maxruns is too small for all of it. */
+uint32_t translate_range(void *va, uint64_t len, vm_run *runs, uint32_t maxruns) {
+	if(vm_current()->pgd == NULL)	return 0;
+	return translate_range_quiet(vm_address(va), len, runs, maxruns, false, false);
+}
+
+uint32_t p_translate_range(void *va, uint64_t len, vm_run *runs, uint32_t maxruns) {
+	if(vm_current()->pgd == NULL)	return 0;
+	return translate_range_quiet(vm_address(va), len, runs, maxruns, false, true);
+}
+
+/* A range within one page is translated through the TLB like translate(), longer ranges
+ * take one walk per run of contiguous frames. Ranges for a write end at pages shared with
+ * a clone, like at unbacked pages. */
+uint32_t translate_range_quiet(address_t va, uint64_t len, vm_run *runs, uint32_t maxruns, bool write, bool threadsafe) {
+	uint32_t n = 0;
+	while(len > 0) {
+		uint32_t offset = get_pageoffset(va);
+		uint64_t chunk = PGSIZE - offset;
+		address_t pa;
+		if(len <= chunk) {
+			pa = translate_quiet(va, write, threadsafe);
+			chunk = len;
+		}else {
+			uint64_t npages;
+			pageno_t pfn = pt_walk_run(va>>_offsetbits, ((va+len-1)>>_offsetbits) - (va>>_offsetbits) + 1, write, &npages);
+			pa = pfn==0 ? 0 : (pfn<<_offsetbits) | offset;
+			chunk = (npages<<_offsetbits) - offset;
+			if(chunk > len)	chunk = len;
+		}
+		if(n>0 && (pa==0 ? runs[n-1].pa==0 : runs[n-1].pa!=0 && runs[n-1].pa+runs[n-1].len==pa))
+			runs[n-1].len += chunk;
+		else {
+			if(n == maxruns)	break;
+			runs[n].pa = pa;
+			runs[n].len = chunk;
+			++n;
+		}
+		va += chunk;
+		len -= chunk;
 	}
-	pageno_t pfn = ptetable[pteindex];
-	hold_wlock(&_tlb_lock[tlbindex]);
-	tlb_add(vpn, pfn);
-	release_lock(&_tlb_lock[tlbindex]);
-	return (pfn<<_offsetbits) | get_pageoffset(va);
+	return n;
 }
 
 /*
@@ -144,65 +528,176 @@ directory to see if there is an existing mapping for a virtual address. If the
 virtual address is not present, then a new entry will be added
 */
 bool page_map(pageno_t vpn, pageno_t pfn) {
-	if(_pgd == NULL)	return false;
+	vm_context *ctx = vm_current();
+	if(ctx->pgd == NULL)	return false;
+	VM_COUNT(page_maps, 1);
+	pte_t *pte = pte_create(ctx, vpn);
+	if(pte==NULL || *pte!=0)	return false;
+	__atomic_store_n(pte, pfn, __ATOMIC_RELEASE);
+	// the owner of a chunk counts its entries without _pagetable_lock
+	__atomic_add_fetch(table_live(pte-(vpn & (_tablesize-1))), 1, __ATOMIC_RELAXED);
+	if(!(pfn & PTE_READONLY))	_frame_vpn[transfer_pfntoppn(pfn)] = vm_tag(ctx, vpn);
+	return true;
+}
+
+/* The pte of vpn in ctx like pte_lookup(), the tables missing on the way are taken from the
+ * pool. NULL when vpn is in a huge mapping or the pool has no table left, callers that must
+ * not fail reserve the tables first. Called with _pagetable_lock held for writing. */
+pte_t *pte_create(vm_context *ctx, pageno_t vpn) {
+	pgd_t *pgd = ctx->pgd;
+	// tables are zeroed before they are published, walkers in p_translate may see them immediately
 	uint32_t pgdindex = vpn>>(3*LEVELBITS);
-	if(_pgd[pgdindex] == NULL) {
-		_pgd[pgdindex] = (pud_t*)calloc(_tablesize, sizeof(address_t));
+	if(pgd[pgdindex] == 0) {
+		address_t *table = table_alloc();
+		if(table == NULL)	return NULL;
+		__atomic_store_n(&pgd[pgdindex], (pgd_t)table, __ATOMIC_RELEASE);
+		++*table_live(pgd);
 	}
 
-	pud_t *pudtable = _pgd[pgdindex];
+	pud_t *pudtable = (pud_t*)pgd[pgdindex];
 	uint32_t pudindex = (vpn>>(2*LEVELBITS)) & ~((~0)<<LEVELBITS);
-	if(pudtable[pudindex] == NULL) {
-		pudtable[pudindex] = (pmd_t*)calloc(_tablesize, sizeof(address_t));
+	if(pudtable[pudindex] == 0) {
+		address_t *table = table_alloc();
+		if(table == NULL)	return NULL;
+		__atomic_store_n(&pudtable[pudindex], (pud_t)table, __ATOMIC_RELEASE);
+		++*table_live(pudtable);
 	}
 	
-	pmd_t *pmdtable = pudtable[pudindex];
+	pmd_t *pmdtable = (pmd_t*)pudtable[pudindex];
 	uint32_t pmdindex = (vpn>>LEVELBITS) & ~((~0)<<LEVELBITS);
-	if(pmdtable[pmdindex] == NULL) {
-		pmdtable[pmdindex] = (pte_t*)calloc(_tablesize, sizeof(address_t));
+	if(pmdtable[pmdindex] & PMD_HUGE)	return NULL;
+	if(pmdtable[pmdindex] == 0) {
+		address_t *table = table_alloc();
+		if(table == NULL)	return NULL;
+		__atomic_store_n(&pmdtable[pmdindex], (pmd_t)table, __ATOMIC_RELEASE);
+		++*table_live(pmdtable);
 	}
 
-	pte_t *ptetable = pmdtable[pmdindex];
-	uint32_t pteindex = vpn & ~((~0)<<LEVELBITS);
-	if(ptetable[pteindex] == 0)	{
-		ptetable[pteindex] = pfn;
-		return true;
-	}else	return false;
+	pte_t *ptetable = (pte_t*)pmdtable[pmdindex];
+	return &ptetable[vpn & ~((~0)<<LEVELBITS)];
+}
+
+/* Map the HUGE_PAGES pages from vpn to the frames from pfn with a single pmd entry. Both
+ * vpn and the frames are aligned to HUGE_PAGES. False when a table for it is missing. */
+bool page_map_huge(pageno_t vpn, pageno_t pfn) {
+	pgd_t *pgd = vm_current()->pgd;
+	if(pgd == NULL)	return false;
+	VM_COUNT(page_maps, 1);
+	uint32_t pgdindex = vpn>>(3*LEVELBITS);
+	if(pgd[pgdindex] == 0) {
+		address_t *table = table_alloc();
+		if(table == NULL)	return false;
+		__atomic_store_n(&pgd[pgdindex], (pgd_t)table, __ATOMIC_RELEASE);
+		++*table_live(pgd);
+	}
+
+	pud_t *pudtable = (pud_t*)pgd[pgdindex];
+	uint32_t pudindex = (vpn>>(2*LEVELBITS)) & ~((~0)<<LEVELBITS);
+	if(pudtable[pudindex] == 0) {
+		address_t *table = table_alloc();
+		if(table == NULL)	return false;
+		__atomic_store_n(&pudtable[pudindex], (pud_t)table, __ATOMIC_RELEASE);
+		++*table_live(pudtable);
+	}
 
+	pmd_t *pmdtable = (pmd_t*)pudtable[pudindex];
+	uint32_t pmdindex = (vpn>>LEVELBITS) & ~((~0)<<LEVELBITS);
+	if(pmdtable[pmdindex] != 0)	return false;
+	__atomic_store_n(&pmdtable[pmdindex], pfn|PMD_HUGE, __ATOMIC_RELEASE);
+	++*table_live(pmdtable);
+	__atomic_add_fetch(&_huge_mapped, 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+/* Split the huge mapping of the block starting at vpn into a pte table over the same frames,
+ * so that part of the block can be unmapped. Walkers see either mapping, both translate
+ * alike. False, with the block still huge, when no table is left for the split. Called with
+ * _pagetable_lock held for writing. */
+bool page_demote(pmd_t *pmdtable, uint32_t pmdindex, pageno_t vpn) {
+	pageno_t pfn = pmdtable[pmdindex] & ~PMD_HUGE;
+	pte_t *ptetable = (pte_t*)table_alloc();
+	if(ptetable == NULL)	return false;
+	for(uint32_t i=0;i<_tablesize;++i)	ptetable[i] = pfn+i;
+	*table_live(ptetable) = _tablesize;
+	__atomic_store_n(&pmdtable[pmdindex], (pmd_t)ptetable, __ATOMIC_RELEASE);
+	tlb_freeupdate(vm_tag(vm_current(), vpn), true);
+	__atomic_sub_fetch(&_huge_mapped, 1, __ATOMIC_RELAXED);
+	return true;
 }
 
 /*Function that gets the next available page */
 void *get_next_avail(uint64_t num_pages) {
-	if(num_pages==0 || num_pages>_pagenum)	return NULL;
-	uint64_t counter, i, j;
-	for(i=0;i<_pagenum;++i) {
-		if(get_bitmap(vbitmap, i)==0) {
-			counter = 1;
-			if(counter == num_pages)	break;
-			for(j=i+1;j<_pagenum;++j) {
-				if(get_bitmap(vbitmap, j)==0)	++counter;
-				else	break;
-				if(counter==num_pages)	break;
+	pageno_t vpn = get_next_avail_vpn(num_pages, NULL);
+	if(vpn == BITMAP_NOTFOUND)	return NULL;
+	return (void*)(vpn<<_offsetbits);
+}
+
+/* Reserve and map num_pages free virtual pages, returns the first vpn or BITMAP_NOTFOUND.
+ * The frames are taken from frames[] when the caller already holds them, otherwise from the
+ * buddy allocator in physically contiguous runs. Called with _pagetable_lock held for writing. */
+pageno_t get_next_avail_vpn(uint64_t num_pages, pageno_t *frames) {
+	if(num_pages==0 || num_pages>_vpagenum)	return BITMAP_NOTFOUND;
+	VM_COUNT(allocs, 1);
+	uint32_t *vbitmap = vm_current()->vbitmap;
+	bool huge = _hugemap && _allocmode==ALLOC_EAGER && frames==NULL && num_pages>=HUGE_PAGES;
+	uint64_t i = BITMAP_NOTFOUND;
+	// large allocations start on a 2 MiB boundary so their blocks can be mapped huge
+	if(huge)	i = bitmap_find_run(vbitmap, num_pages, HUGE_PAGES);
+	if(i == BITMAP_NOTFOUND)	i = bitmap_find_run(vbitmap, num_pages, 1);
+	if(i == BITMAP_NOTFOUND)	return BITMAP_NOTFOUND;
+	if(_allocmode==ALLOC_LAZY || _swapon || _native) {
+		// frames are bound by page_fault() on the first write
+		for(pageno_t vpn=i;vpn<i+num_pages;++vpn)	set_bitmap(vbitmap, vpn);
+		return i;
+	}
+	pageno_t vpn=i, ppn, pfn;
+	uint64_t run, left;
+	// growing the table pool takes _frame_lock too
+	if(!table_reserve(i, num_pages))	return BITMAP_NOTFOUND;
+	if(frames == NULL) {
+		pthread_mutex_lock(&_frame_lock);
+		// every block of frames can be split down to single frames, so enough free frames means success
+		if(_buddy_freeframes < num_pages) {
+			// frames parked in the caches of other threads count as free
+			pthread_mutex_unlock(&_frame_lock);
+			frame_cache_reclaim();
+			pthread_mutex_lock(&_frame_lock);
+		}
+		if(_buddy_freeframes < num_pages) {
+			pthread_mutex_unlock(&_frame_lock);
+			return BITMAP_NOTFOUND;
+		}
+	}
+	// i corresponds to the 1st virtual page
+	while(vpn < i+num_pages) {
+		left = i+num_pages-vpn;
+		if(huge && (vpn&(HUGE_PAGES-1))==0 && left>=HUGE_PAGES && (ppn=buddy_alloc(HUGE_ORDER))!=BUDDY_NIL) {
+			for(uint64_t k=0;k<HUGE_PAGES;++k)	set_bitmap(vbitmap, vpn+k);
+			if(page_map_huge(vpn, transfer_ppntopfn(ppn)) == false) {
+				fprintf(stderr, "page_map_huge for vpn=%"PRIu64" fails!\n", vpn);
+				exit(1);
+			}
+			vpn += HUGE_PAGES;
+			continue;
+		}
+		// without a free 2 MiB block, 4K runs stop at the next block boundary so the blocks after it may still be huge
+		if(huge && left>HUGE_PAGES-(vpn&(HUGE_PAGES-1)))	left = HUGE_PAGES-(vpn&(HUGE_PAGES-1));
+		if(frames != NULL) {
+			ppn = frames[vpn-i];
+			run = 1;
+		}else	run = buddy_alloc_run(left, &ppn);
+		for(uint64_t k=0;k<run;++k,++vpn,++ppn) {
+			set_bitmap(vbitmap, vpn);
+			pfn = transfer_ppntopfn(ppn);
+			if(page_map(vpn, pfn) == false) {
+				fprintf(stderr, "page_mmap for vpn=%"PRIu32" pfn=%"PRIu32" fails!\n", vpn, pfn);
+				exit(1);
 			}
-			if(counter==num_pages)	break;
-			i = j;
-		}
-	}
-	if(counter != num_pages)	return NULL;
-	// i corresponds to the 1st virtual page, and j to the last
-	pageno_t vpn, ppn=0, pfn;
-	for(vpn=i;vpn<i+num_pages;++vpn) {
-		while(get_bitmap(pbitmap, ppn))	++ppn;
-		set_bitmap(vbitmap, vpn);
-		set_bitmap(pbitmap, ppn);
-		pfn = transfer_ppntopfn(ppn);
-		if(page_map(vpn, pfn) == false) {
-			fprintf(stderr, "page_mmap for vpn=%"PRIu32" pfn=%"PRIu32" fails!\n", vpn, pfn);
-			exit(1);
 		}
 	}
+	if(frames == NULL)	pthread_mutex_unlock(&_frame_lock);
 	
-	return (void*)(i<<_offsetbits);
+	return i;
 }
 
 /* Function responsible for allocating pages and used by the benchmark */
@@ -211,18 +706,17 @@ void *a_malloc(uint64_t num_bytes) {
 	if(_init_physical == false)	set_physical_mem();
 	/* HINT: If the page directory is not initialized, then initialize the page directory. Next, using get_next_avail(), check if there are free pages. If
 	free pages are available, set the bitmaps and map a new page. Note, you will have to mark which physical pages are used. */
-	if(num_bytes==0 || num_bytes>MAX_MEMSIZE)	return NULL;
+	if(num_bytes==0 || num_bytes>MAX_VIRTSIZE)	return NULL;
+	if(num_bytes <= SLAB_MAXSIZE)	return vm_native(slab_alloc(num_bytes, false));
 	uint64_t num_pages = num_bytes>>_offsetbits;
 	if(num_bytes&~((~0)<<_offsetbits))	++num_pages;
 	void *malloc_address = get_next_avail(num_pages);
-	return malloc_address;
+	return vm_native(malloc_address);
 }
 
 void *umalloc(uint64_t num_bytes) {
 
-	if(num_bytes==0 || num_bytes>MAX_MEMSIZE)	return NULL;
-	uint64_t num_pages = num_bytes>>_offsetbits;
-	if(num_bytes&~((~0)<<_offsetbits))	++num_pages;
+	if(num_bytes==0 || num_bytes>MAX_VIRTSIZE)	return NULL;
 
 	if(0 != pthread_mutex_lock(&_init_mutex)) {
 		fprintf(stderr, "pthread_mutex_lock(&_init_mutex) fails!\n");
@@ -231,100 +725,176 @@ void *umalloc(uint64_t num_bytes) {
 	if(_init_physical == false)	set_physical_mem();
 	pthread_mutex_unlock(&_init_mutex);
 
+	if(num_bytes <= SLAB_MAXSIZE)	return vm_native(slab_alloc(num_bytes, true));
+	// _offsetbits is only known once the physical memory is set up
+	uint64_t num_pages = num_bytes>>_offsetbits;
+	if(num_bytes&~((~0)<<_offsetbits))	++num_pages;
+
+	pageno_t vpn = page_alloc(num_pages, true);
+	if(vpn == BITMAP_NOTFOUND)	return NULL;
+	return vm_native((void*)(vpn<<_offsetbits));
+
+}
+
+/* Reserve num_pages pages, returns the first vpn or BITMAP_NOTFOUND. The thread safe version
+ * takes small requests from the thread's frame cache and maps them in its chunk, only when
+ * that is full is the page table lock taken. */
+pageno_t page_alloc(uint64_t num_pages, bool threadsafe) {
+	if(!threadsafe)	return get_next_avail_vpn(num_pages, NULL);
+
+	pageno_t frames[FRAME_CACHE_MAXPAGES], *cached = NULL;
+	if(num_pages<=FRAME_CACHE_MAXPAGES && _allocmode==ALLOC_EAGER && !_swapon && !_native) {
+		if(frame_cache_get(num_pages, frames) == false)	return BITMAP_NOTFOUND;
+		cached = frames;
+		pageno_t vpn = chunk_map(num_pages, frames);
+		if(vpn != BITMAP_NOTFOUND)	return vpn;
+	}
+
 	hold_wlock(&_pagetable_lock);
-	void *malloc_address = get_next_avail(num_pages);
+	pageno_t vpn = get_next_avail_vpn(num_pages, cached);
 	release_lock(&_pagetable_lock);
-	return malloc_address;
+	if(vpn==BITMAP_NOTFOUND && cached!=NULL)
+		for(uint64_t k=0;k<num_pages;++k)	frame_free(frames[k]);
+	return vpn;
+}
+
+/* Small eager allocations of the default context are mapped in a chunk of the calling thread:
+ * a pte table of _tablesize pages whose vbitmap bits stay set while the thread owns it, so no
+ * other allocation lands there. Only the owner turns a zero pte of the chunk into a mapping,
+ * so it maps the frames[] at num_pages free ptes without _pagetable_lock; a new chunk is
+ * reserved under the lock when the current one has no such run. Returns the first vpn or
+ * BITMAP_NOTFOUND. */
+pageno_t chunk_map(uint64_t num_pages, pageno_t *frames) {
+	if(_vm_current != NULL)	return BITMAP_NOTFOUND;
+	frame_cache *cache = frame_cache_current();
+	uint32_t k = _tablesize, run = 0;
+	for(int tries=0;tries<2 && k==_tablesize;++tries) {
+		if(tries > 0) {
+			hold_wlock(&_pagetable_lock);
+			chunk_release(cache);
+			chunk_reserve(cache);
+			release_lock(&_pagetable_lock);
+		}
+		if(cache->chunk == BITMAP_NOTFOUND)	continue;
+		// first fit from where the last search stopped, wrapping around once
+		for(uint32_t i=0;i<_tablesize && k==_tablesize;++i) {
+			uint32_t idx = (cache->chunk_next+i) & (_tablesize-1);
+			if(idx == 0)	run = 0;
+			if(__atomic_load_n(&cache->chunk_table[idx], __ATOMIC_RELAXED) != 0)	run = 0;
+			else if(++run == num_pages)	k = idx+1-run;
+		}
+		run = 0;
+	}
+	if(k == _tablesize)	return BITMAP_NOTFOUND;
+	VM_COUNT(allocs, 1);
+	VM_COUNT(page_maps, num_pages);
+	pageno_t vpn = cache->chunk+k;
+	for(uint64_t i=0;i<num_pages;++i) {
+		_frame_vpn[frames[i]] = vm_tag(&_vm_default, vpn+i);
+		__atomic_store_n(&cache->chunk_table[k+i], transfer_ppntopfn(frames[i]), __ATOMIC_RELEASE);
+	}
+	__atomic_add_fetch(table_live(cache->chunk_table), num_pages, __ATOMIC_RELAXED);
+	cache->chunk_next = (k+num_pages) & (_tablesize-1);
+	return vpn;
+}
+
+/* Free [vpn, vpn+num_pages) if it lies in the calling thread's chunk and every page is mapped
+ * to a frame only it uses, without _pagetable_lock. False when unmap_pages() has to do it:
+ * the pages are not ours, shared with a clone, pinned or swapped out. */
+bool chunk_unmap(pageno_t vpn, uint64_t num_pages) {
+	frame_cache *cache = _frame_local;
+	if(cache==NULL || cache->chunk==BITMAP_NOTFOUND || _vm_current!=NULL || _swapon)	return false;
+	if(vpn<cache->chunk || vpn+num_pages>cache->chunk+_tablesize)	return false;
+	pte_t *ptes = &cache->chunk_table[vpn-cache->chunk];
+	for(uint64_t k=0;k<num_pages;++k) {
+		pte_t entry = __atomic_load_n(&ptes[k], __ATOMIC_RELAXED);
+		if(entry==0 || (entry & (PTE_SWAPPED|PTE_READONLY)) || _frame_pin[transfer_pfntoppn(entry)]!=0)
+			return false;
+	}
+	VM_COUNT(pages_freed, num_pages);
+	pageno_t frames[1<<LEVELBITS];
+	for(uint64_t k=0;k<num_pages;++k) {
+		frames[k] = transfer_pfntoppn(ptes[k]);
+		__atomic_store_n(&ptes[k], 0, __ATOMIC_RELEASE);
+	}
+	// never reaches 0, TABLE_CHUNK keeps the table linked
+	__atomic_sub_fetch(table_live(cache->chunk_table), num_pages, __ATOMIC_RELAXED);
+	tlb_freerange(vm_tag(&_vm_default, vpn), num_pages);
+	for(uint64_t k=0;k<num_pages;++k)	frame_put(frames[k]);
+	return true;
+}
 
+/* Take a free aligned pte table worth of virtual pages of the default context as the chunk
+ * of cache, none when no such range or no frame for its tables is left. Called with
+ * _pagetable_lock held for writing. */
+void chunk_reserve(frame_cache *cache) {
+	pageno_t vpn = bitmap_find_run(_vm_default.vbitmap, _tablesize, _tablesize);
+	if(vpn==BITMAP_NOTFOUND || !table_reserve(vpn, _tablesize))	return;
+	pte_t *ptetable = pte_create(&_vm_default, vpn);
+	if(ptetable == NULL)	return;
+	for(uint32_t k=0;k<_tablesize;++k)	set_bitmap(_vm_default.vbitmap, vpn+k);
+	__atomic_or_fetch(table_live(ptetable), TABLE_CHUNK, __ATOMIC_RELAXED);
+	cache->chunk = vpn;
+	cache->chunk_table = ptetable;
+	cache->chunk_next = 0;
+}
+
+/* Give the chunk of cache back: its pages without a mapping are free again, the others stay
+ * allocated like any page. Called with _pagetable_lock held for writing, by the owner. */
+void chunk_release(frame_cache *cache) {
+	pageno_t vpn = cache->chunk;
+	if(vpn == BITMAP_NOTFOUND)	return;
+	pte_t *ptetable = cache->chunk_table;
+	cache->chunk = BITMAP_NOTFOUND;
+	for(uint32_t k=0;k<_tablesize;++k)
+		if(ptetable[k] == 0)	clear_bitmap(_vm_default.vbitmap, vpn+k);
+	if(__atomic_and_fetch(table_live(ptetable), (uint16_t)~TABLE_CHUNK, __ATOMIC_RELAXED) != 0)	return;
+	address_t va = vpn<<_offsetbits;
+	pmd_t *pmdtable = (pmd_t*)((pud_t*)_vm_default.pgd[get_pgdindex(va)])[get_pudindex(va)];
+	__atomic_store_n(&pmdtable[get_pmdindex(va)], 0, __ATOMIC_RELEASE);
+	table_retire(ptetable);
+	--*table_live(pmdtable);
+	unmap_prune(vpn, 1);
 }
 
 /* Responsible for releasing one or more memory pages using virtual address (va) */
 void a_free(void *va, uint64_t size) {
     //Free the page table entries starting from this virtual address (va) Also mark the pages free in the bitmap
     //Only free if the memory from "va" to va+size is valid
-	if(size==0 || size>MAX_MEMSIZE)	return;
+	if(size==0 || size>MAX_VIRTSIZE)	return;
 
 	uint64_t num_pages = size>>_offsetbits;
 	if(size & ~((~0)<<_offsetbits))	++num_pages;
 
+	va = (void*)vm_address(va);
 	pageno_t vpn = ((address_t)va)>>_offsetbits;
+	VM_COUNT(frees, 1);
+	if(slab_free(va, false))	return;
 	bool free_flag = true;
+	uint32_t *vbitmap = vm_current()->vbitmap;
 	for(pageno_t i=vpn;i<vpn+num_pages;++i)
 		if(get_bitmap(vbitmap, i)==0) {
 			free_flag = false;
 			break;
 		}
 	
-	if(free_flag) {
-		uint32_t pgdindex, pudindex, pmdindex, pteindex;
-		pageno_t pfn, ppn;
-		for(pageno_t ivpn=vpn;ivpn<vpn+num_pages;++ivpn) {
-			pgdindex = ivpn>>(3*LEVELBITS);
-			pudindex = (ivpn>>(2*LEVELBITS)) & ~((~0)<<LEVELBITS);
-			pmdindex = (ivpn>>LEVELBITS) & ~((~0)<<LEVELBITS);
-			pteindex = ivpn & ~((~0)<<LEVELBITS);
-
-			pud_t *pudtable = _pgd[pgdindex];
-			pmd_t *pmdtable = pudtable[pudindex];
-			pte_t *ptetable = pmdtable[pmdindex];
-			pfn = ptetable[pteindex];
-
-			tlb_freeupdate(vpn);
-			ptetable[pteindex] = 0;
-			// free the ptetable if necessary
-			bool freetable_flag = true;
-			for(uint32_t i=0;i<_tablesize;++i)
-				if(ptetable[i]!=0) {
-					freetable_flag = false;
-					break;
-				}
-
-			if(freetable_flag) {
-				free(pmdtable[pmdindex]);
-				pmdtable[pmdindex] = 0;
-
-				// free the pmdtable if necessary
-				for(uint32_t i=0;i<_tablesize;++i)
-					if(pmdtable[i]!=0) {
-						freetable_flag = false;
-						break;
-					}
-
-				if(freetable_flag) {
-					free(pudtable[pudindex]);
-					pudtable[pudindex] = 0;
-
-					// free the pudtable if necessary
-					for(uint32_t i=0;i<_tablesize;++i)
-						if(pudtable[i]!=0) {
-							freetable_flag = false;
-							break;
-						}
-
-					if(freetable_flag) {
-						free(_pgd[pgdindex]);
-						_pgd[pgdindex] = 0;
-					}
-				}
-			}
-
-			ppn = transfer_pfntoppn(pfn);
-			clear_bitmap(pbitmap, ppn);
-			clear_bitmap(vbitmap, ivpn);
-		}
-	} // end of free process
+	if(free_flag)	unmap_pages(vpn, num_pages);
 }
 
 void ufree(void *va, uint64_t size) {
     //Free the page table entries starting from this virtual address (va) Also mark the pages free in the bitmap
     //Only free if the memory from "va" to va+size is valid
-	if(size==0 || size>MAX_MEMSIZE)	return;
+	if(size==0 || size>MAX_VIRTSIZE)	return;
 
 	uint64_t num_pages = size>>_offsetbits;
 	if(size & ~((~0)<<_offsetbits))	++num_pages;
 
+	va = (void*)vm_address(va);
 	pageno_t vpn = ((address_t)va)>>_offsetbits;
+	VM_COUNT(frees, 1);
+	if(slab_free(va, true) || chunk_unmap(vpn, num_pages))	return;
 	bool free_flag = true;
+	uint32_t *vbitmap = vm_current()->vbitmap;
 	hold_wlock(&_pagetable_lock);
 	for(pageno_t i=vpn;i<vpn+num_pages;++i)
 		if(get_bitmap(vbitmap, i)==0) {
@@ -332,386 +902,2590 @@ void ufree(void *va, uint64_t size) {
 			break;
 		}
 	
-	if(free_flag) {
-		uint32_t pgdindex, pudindex, pmdindex, pteindex;
-		pageno_t pfn, ppn;
-		for(pageno_t ivpn=vpn;ivpn<vpn+num_pages;++ivpn) {
-			pgdindex = ivpn>>(3*LEVELBITS);
-			pudindex = (ivpn>>(2*LEVELBITS)) & ~((~0)<<LEVELBITS);
-			pmdindex = (ivpn>>LEVELBITS) & ~((~0)<<LEVELBITS);
-			pteindex = ivpn & ~((~0)<<LEVELBITS);
-
-			pud_t *pudtable = _pgd[pgdindex];
-			pmd_t *pmdtable = pudtable[pudindex];
-			pte_t *ptetable = pmdtable[pmdindex];
-			pfn = ptetable[pteindex];
-			
-			tlb_freeupdate(vpn);
-			ptetable[pteindex] = 0;
-			// free the ptetable if necessary
-			bool freetable_flag = true;
-			for(uint32_t i=0;i<_tablesize;++i)
-				if(ptetable[i]!=0) {
-					freetable_flag = false;
-					break;
-				}
-
-			if(freetable_flag) {
-				free(pmdtable[pmdindex]);
-				pmdtable[pmdindex] = 0;
-
-				// free the pmdtable if necessary
-				for(uint32_t i=0;i<_tablesize;++i)
-					if(pmdtable[i]!=0) {
-						freetable_flag = false;
-						break;
-					}
-
-				if(freetable_flag) {
-					free(pudtable[pudindex]);
-					pudtable[pudindex] = 0;
-
-					// free the pudtable if necessary
-					for(uint32_t i=0;i<_tablesize;++i)
-						if(pudtable[i]!=0) {
-							freetable_flag = false;
-							break;
-						}
-
-					if(freetable_flag) {
-						free(_pgd[pgdindex]);
-						_pgd[pgdindex] = 0;
-					}
-				}
-			}
-
-			ppn = transfer_pfntoppn(pfn);
-			clear_bitmap(pbitmap, ppn);
-			clear_bitmap(vbitmap, ivpn);
-		}
-	} // end of free process
+	if(free_flag)	unmap_pages(vpn, num_pages);
 	release_lock(&_pagetable_lock);
 }
 
-/* The function copies data pointed by "val" to physical
- * memory pages using virtual address (va)
-*/
-void put_value(void *va, void *val, int size) {
-    /* HINT: Using the virtual address and translate(), find the physical page. Copy
-       the contents of "val" to a physical page. NOTE: The "size" value can be larger
-       than one page. Therefore, you may have to find multiple pages using translate()
-       function.*/
-	if(size<=0 || val==NULL)	return;
-	pageno_t vpn_start = (address_t)va >> _offsetbits;
-	pageno_t vpn_end = ((address_t)va + size-1) >> _offsetbits;
-	address_t pa;
-
-	// check the validation first!
-	for(pageno_t vpn=vpn_start;vpn<=vpn_end;++vpn)	if(get_bitmap(vbitmap, vpn)==0)	return;
-
-	if(vpn_start == vpn_end) {
-		pa = translate((address_t)va);
-		if(pa == 0)	return;
-		memcpy((void*)pa, val, size);
-	}else {
-		uint64_t remain = ((vpn_start+1)<<_offsetbits) - (address_t)va;
-		pa = translate((address_t)va);
-		if(pa == 0)	return;
-		memcpy((void*)pa, val, remain);
-		val = (void*)((address_t)val + remain);
-		size -= remain;
-		address_t va_tmp;
-		for(pageno_t vpn_mid=vpn_start+1;vpn_mid<vpn_end;++vpn_mid) {
-			va_tmp = vpn_mid << _offsetbits;
-			pa = translate(va_tmp);
-			if(pa == 0)	return;
-			memcpy((void*)pa, val, PGSIZE);
-			size -= PGSIZE;
-			val = (void*)((address_t)val + PGSIZE);
+/* Release the pages [vpn, vpn+num_pages) and their frames, one pte table at a time: the
+ * entries are cleared, the TLBs invalidated for the whole chunk at once, and only then are the
+ * frames freed. Tables left without live entries are unlinked, a table the range covers
+ * completely is unlinked without clearing its entries. Pages of a lazy allocation that were
+ * never written only have their vbitmap bit, swapped out pages give back their slot. */
+void unmap_pages(pageno_t vpn, uint64_t num_pages) {
+	const uint64_t pmdspan = 1ULL<<(2*LEVELBITS), pudspan = 1ULL<<(3*LEVELBITS);
+	uint32_t pgdindex, pudindex, pmdindex, pteindex, n;
+	pageno_t frames[1<<LEVELBITS], end = vpn+num_pages, ivpn = vpn, next;
+	vm_context *ctx = vm_current();
+	uint32_t *vbitmap = ctx->vbitmap;
+	VM_COUNT(pages_freed, num_pages);
+	native_drop(vm_tag(ctx, vpn), num_pages);
+	while(ivpn < end) {
+		pgdindex = ivpn>>(3*LEVELBITS);
+		pudindex = (ivpn>>(2*LEVELBITS)) & ~((~0)<<LEVELBITS);
+		pmdindex = (ivpn>>LEVELBITS) & ~((~0)<<LEVELBITS);
+		pteindex = ivpn & ~((~0)<<LEVELBITS);
+
+		pud_t *pudtable = (pud_t*)ctx->pgd[pgdindex];
+		pmd_t *pmdtable = pudtable==NULL ? NULL : (pmd_t*)pudtable[pudindex];
+		if(pmdtable == NULL) {
+			next = (ivpn | ((pudtable==NULL ? pudspan : pmdspan)-1)) + 1;
+			if(next > end)	next = end;
+			for(;ivpn<next;++ivpn)	clear_bitmap(vbitmap, ivpn);
+			continue;
 		}
-
-		pa = translate((address_t)(vpn_end<<_offsetbits));
-		if(pa == 0)	return;
-		memcpy((void*)pa, val, size);
-	}
-}
-
-void put_val(void *va, void *val, int size) {
-    /* HINT: Using the virtual address and translate(), find the physical page. Copy
-       the contents of "val" to a physical page. NOTE: The "size" value can be larger
-       than one page. Therefore, you may have to find multiple pages using translate()
-       function.*/
-	if(size<=0 || val==NULL)	return;
-	pageno_t vpn_start = (address_t)va >> _offsetbits;
-	pageno_t vpn_end = ((address_t)va + size-1) >> _offsetbits;
-	address_t pa;
-
-	hold_rlock(&_pagetable_lock);
-	// check the validation first!
-	for(pageno_t vpn=vpn_start;vpn<=vpn_end;++vpn)	
-		if(get_bitmap(vbitmap, vpn)==0)	{
-			release_lock(&_pagetable_lock);
-			return;
+		next = (ivpn | (pmdspan-1)) + 1;
+		if(pmdindex==0 && pteindex==0 && next<=end) {
+			unmap_subtree(pudtable, pudindex, ivpn);
+			for(;ivpn<next;++ivpn)	clear_bitmap(vbitmap, ivpn);
+			continue;
 		}
 
-	if(vpn_start == vpn_end) {
-		pa = p_translate((address_t)va);
-		if(pa == 0)	{
-			release_lock(&_pagetable_lock);
-			return;
-		}
-		memcpy((void*)pa, val, size);
-	}else {
-		uint64_t remain = ((vpn_start+1)<<_offsetbits) - (address_t)va;
-		pa = p_translate((address_t)va);
-		if(pa == 0)	{
-			release_lock(&_pagetable_lock);
-			return;
-		}
-		memcpy((void*)pa, val, remain);
-		val = (void*)((address_t)val + remain);
-		size -= remain;
-		address_t va_tmp;
-		for(pageno_t vpn_mid=vpn_start+1;vpn_mid<vpn_end;++vpn_mid) {
-			va_tmp = vpn_mid << _offsetbits;
-			pa = p_translate(va_tmp);
-			if(pa == 0)	{
-				release_lock(&_pagetable_lock);
-				return;
+		next = (ivpn | (_tablesize-1)) + 1;
+		if(next > end)	next = end;
+		if(pmdtable[pmdindex] & PMD_HUGE) {
+			if(pteindex!=0 || next-ivpn<HUGE_PAGES) {
+				// only part of the block goes away
+				if(page_demote(pmdtable, pmdindex, ivpn-pteindex) == false) {
+					// the pages stay mapped and allocated
+					fprintf(stderr, "unmap_pages for vpn=%"PRIu64": no page table to split the huge mapping!\n", ivpn);
+					ivpn = next;
+					continue;
+				}
+			}else {
+				pageno_t ppn = transfer_pfntoppn(pmdtable[pmdindex] & ~PMD_HUGE);
+				__atomic_store_n(&pmdtable[pmdindex], 0, __ATOMIC_RELEASE);
+				--*table_live(pmdtable);
+				tlb_freeupdate(vm_tag(ctx, ivpn), true);
+				__atomic_sub_fetch(&_huge_mapped, 1, __ATOMIC_RELAXED);
+				unmap_prune(ivpn, 1);
+				for(uint64_t k=0;k<HUGE_PAGES;++k)	clear_bitmap(vbitmap, ivpn+k);
+				// the block goes straight back to the buddy allocator, it is too big for the frame cache
+				pthread_mutex_lock(&_frame_lock);
+				buddy_free(ppn, HUGE_ORDER);
+				pthread_mutex_unlock(&_frame_lock);
+				ivpn = next;
+				continue;
 			}
-			memcpy((void*)pa, val, PGSIZE);
-			size -= PGSIZE;
-			val = (void*)((address_t)val + PGSIZE);
-		}
-
-		pa = p_translate((address_t)(vpn_end<<_offsetbits));
-		if(pa == 0)	{
-			release_lock(&_pagetable_lock);
-			return;
 		}
-		memcpy((void*)pa, val, size);
-	}
-	release_lock(&_pagetable_lock);
-}
 
-/*Given a virtual address, this function copies the contents of the page to val*/
-void get_value(void *va, void *val, int size) {
-    /* HINT: put the values pointed to by "va" inside the physical memory at given
-    "val" address. Assume you can access "val" directly by derefencing them.
-    If you are implementing TLB,  always check first the presence of translation in TLB before proceeding forward */
-	if(size<=0 || val==NULL)	return;
-	pageno_t vpn_start = (address_t)va >> _offsetbits;
-	pageno_t vpn_end = ((address_t)va+size-1) >> _offsetbits;
-	address_t pa;
-	if(vpn_start == vpn_end) {
-		pa = translate((address_t)va);
-		if(pa == 0)	return;
-		memcpy(val, (void*)pa, size);
-	}else {
-		uint32_t remain = ((vpn_start+1)<<_offsetbits) - (address_t)va;
-		pa = translate((address_t)va);
-		if(pa == 0)	return;
-		memcpy(val, (void*)pa, remain);
-		val = (void*)((address_t)val + remain);
-		size -= remain;
-		address_t va_tmp;
-		for(pageno_t vpn_mid=vpn_start+1;vpn_mid<vpn_end;++vpn_mid) {
-			va_tmp = vpn_mid << _offsetbits;
-			pa = translate(va_tmp);
-			if(pa == 0)	return;
-			memcpy(val, (void*)pa, PGSIZE);
-			size -= PGSIZE;
-			val = (void*)((address_t)val + PGSIZE);
+		pte_t *ptetable = (pte_t*)pmdtable[pmdindex];
+		// the pages of a thread's chunk stay reserved for it, see chunk_map(); its owner updates the count without the lock
+		bool chunk = ptetable!=NULL && (__atomic_load_n(table_live(ptetable), __ATOMIC_RELAXED) & TABLE_CHUNK);
+		n = 0;
+		if(ptetable == NULL) {
+		}else if(pteindex==0 && next-ivpn==_tablesize && !chunk) {
+			__atomic_store_n(&pmdtable[pmdindex], 0, __ATOMIC_RELEASE);
+			for(uint32_t i=0;i<_tablesize;++i) {
+				pte_t entry = ptetable[i];
+				if(entry & PTE_SWAPPED)	swap_release(entry);
+				else if(entry != 0)	frames[n++] = transfer_pfntoppn(entry & PTE_PFNMASK);
+			}
+			table_retire(ptetable);
+			--*table_live(pmdtable);
+			unmap_prune(ivpn, 1);
+		}else {
+			uint32_t cleared = 0;
+			for(pageno_t k=ivpn;k<next;++k) {
+				pte_t entry = ptetable[k & (_tablesize-1)];
+				if(entry == 0)	continue;
+				__atomic_store_n(&ptetable[k & (_tablesize-1)], 0, __ATOMIC_RELEASE);
+				++cleared;
+				if(entry & PTE_SWAPPED)	swap_release(entry);
+				else	frames[n++] = transfer_pfntoppn(entry & PTE_PFNMASK);
+			}
+			if(__atomic_sub_fetch(table_live(ptetable), cleared, __ATOMIC_RELAXED) == 0) {
+				__atomic_store_n(&pmdtable[pmdindex], 0, __ATOMIC_RELEASE);
+				table_retire(ptetable);
+				--*table_live(pmdtable);
+				unmap_prune(ivpn, 1);
+			}
 		}
-
-		pa = translate((address_t)(vpn_end<<_offsetbits));
-		if(pa == 0)	return;
-		memcpy(val, (void*)pa, size);
+		if(n > 0)	tlb_freerange(vm_tag(ctx, ivpn), next-ivpn);
+		for(uint32_t i=0;i<n;++i)	frame_put(frames[i]);
+		if(chunk)	ivpn = next;
+		for(;ivpn<next;++ivpn)	clear_bitmap(vbitmap, ivpn);
 	}
+	ebr_reclaim();
 }
 
-void get_val(void *va, void *val, int size) {
-    /* HINT: put the values pointed to by "va" inside the physical memory at given
-    "val" address. Assume you can access "val" directly by derefencing them.
-    If you are implementing TLB,  always check first the presence of translation in TLB before proceeding forward */
-	if(size<=0 || val==NULL)	return;
-	pageno_t vpn_start = (address_t)va >> _offsetbits;
-	pageno_t vpn_end = ((address_t)va+size-1) >> _offsetbits;
-	address_t pa;
-	hold_rlock(&_pagetable_lock);
-	if(vpn_start == vpn_end) {
-		pa = p_translate((address_t)va);
-		if(pa == 0)	{
-			release_lock(&_pagetable_lock);
-			return;
-		}
-		memcpy(val, (void*)pa, size);
-	}else {
-		uint32_t remain = ((vpn_start+1)<<_offsetbits) - (address_t)va;
-		pa = p_translate((address_t)va);
-		if(pa == 0)	{
-			release_lock(&_pagetable_lock);
-			return;
-		}
-		memcpy(val, (void*)pa, remain);
-		val = (void*)((address_t)val + remain);
-		size -= remain;
-		address_t va_tmp;
-		for(pageno_t vpn_mid=vpn_start+1;vpn_mid<vpn_end;++vpn_mid) {
-			va_tmp = vpn_mid << _offsetbits;
-			pa = translate(va_tmp);
-			if(pa == 0)	{
-				release_lock(&_pagetable_lock);
-				return;
-			}
-			memcpy(val, (void*)pa, PGSIZE);
-			size -= PGSIZE;
-			val = (void*)((address_t)val + PGSIZE);
+/* Drop the pmd table at pudtable[pudindex] with everything below it, when the freed range
+ * covers all of the pages from vpn it maps. */
+void unmap_subtree(pud_t *pudtable, uint32_t pudindex, pageno_t vpn) {
+	pmd_t *pmdtable = (pmd_t*)pudtable[pudindex];
+	__atomic_store_n(&pudtable[pudindex], 0, __ATOMIC_RELEASE);
+	--*table_live(pudtable);
+	tlb_freerange(vm_tag(vm_current(), vpn), 1ULL<<(2*LEVELBITS));
+	for(uint32_t i=0;i<_tablesize;++i) {
+		pmd_t pmd = pmdtable[i];
+		if(pmd == 0)	continue;
+		if(pmd & PMD_HUGE) {
+			pageno_t ppn = transfer_pfntoppn(pmd & ~PMD_HUGE);
+			pthread_mutex_lock(&_frame_lock);
+			buddy_free(ppn, HUGE_ORDER);
+			pthread_mutex_unlock(&_frame_lock);
+			__atomic_sub_fetch(&_huge_mapped, 1, __ATOMIC_RELAXED);
+			continue;
 		}
-
-		pa = translate((address_t)(vpn_end<<_offsetbits));
-		if(pa == 0)	{
-			release_lock(&_pagetable_lock);
-			return;
+		pte_t *ptetable = (pte_t*)pmd;
+		for(uint32_t k=0;k<_tablesize;++k) {
+			pte_t entry = ptetable[k];
+			if(entry & PTE_SWAPPED)	swap_release(entry);
+			else if(entry != 0)	frame_put(transfer_pfntoppn(entry & PTE_PFNMASK));
 		}
-		memcpy(val, (void*)pa, size);
+		table_retire(ptetable);
 	}
-	release_lock(&_pagetable_lock);
+	table_retire(pmdtable);
+	unmap_prune(vpn, 2);
 }
 
-/*
-This function receives two matrices mat1 and mat2 as an argument with size
-argument representing the number of rows and columns. After performing matrix multiplication, copy the result to answer.
-*/
-void mat_mult(void *mat1, void *mat2, int size, void *answer) {
-    /* Hint: You will index as [i * size + j] where  "i, j" are the indices of the
-    matrix accessed. Similar to the code in test.c, you will use get_value() to
-    load each element and perform multiplication. Take a look at test.c! In addition to 
-    getting the values from two matrices, you will perform multiplication and store the result to the "answer array"*/
-	address_t address_m1, address_m2, address_ans;
-	int tmp, tmp1, tmp2;
-	for(uint64_t i=0;i<size;++i)
-		for(uint64_t j=0;j<size;++j) {
-			tmp = 0;
-			for(uint64_t k=0;k<size;++k) {
-				address_m1 = (address_t)mat1 + (i*size+k)*sizeof(int);
-				address_m2 = (address_t)mat2 + (k*size+j)*sizeof(int);
-				get_value((void*)address_m1, &tmp1, sizeof(int));
-				get_value((void*)address_m2, &tmp2, sizeof(int));
-				tmp += tmp1*tmp2;
-			}
-			address_ans = (address_t)answer + (i*size+j)*sizeof(int);
-			put_value((void*)address_ans, &tmp, sizeof(int));
-		}
-	
+/* A table on the path to vpn lost an entry, the pmd table for level 1, the pud table for
+ * level 2. Tables left without live entries are unlinked and retired going up, the pgd stays. */
+void unmap_prune(pageno_t vpn, uint32_t level) {
+	uint32_t pgdindex = vpn>>(3*LEVELBITS);
+	uint32_t pudindex = (vpn>>(2*LEVELBITS)) & ~((~0)<<LEVELBITS);
+	pgd_t *pgd = vm_current()->pgd;
+	pud_t *pudtable = (pud_t*)pgd[pgdindex];
+	if(level == 1) {
+		pmd_t *pmdtable = (pmd_t*)pudtable[pudindex];
+		if(*table_live(pmdtable) != 0)	return;
+		__atomic_store_n(&pudtable[pudindex], 0, __ATOMIC_RELEASE);
+		table_retire(pmdtable);
+		--*table_live(pudtable);
+	}
+	if(*table_live(pudtable) != 0)	return;
+	__atomic_store_n(&pgd[pgdindex], 0, __ATOMIC_RELEASE);
+	table_retire(pudtable);
+	--*table_live(pgd);
 }
 
-void p_mat_mult(void *mat1, void *mat2, int size, void *answer) {
-	address_t address_m1, address_m2, address_ans;
-	int tmp, tmp1, tmp2;
-	for(uint64_t i=0;i<size;++i)
-		for(uint64_t j=0;j<size;++j) {
-			tmp = 0;
-			for(uint64_t k=0;k<size;++k) {
-				address_m1 = (address_t)mat1 + (i*size+k)*sizeof(int);
-				address_m2 = (address_t)mat2 + (k*size+j)*sizeof(int);
-				get_val((void*)address_m1, &tmp1, sizeof(int));
-				get_val((void*)address_m2, &tmp2, sizeof(int));
-				tmp += tmp1*tmp2;
-			}
-			address_ans = (address_t)answer + (i*size+j)*sizeof(int);
-			put_val((void*)address_ans, &tmp, sizeof(int));
-		}
-	
+/* Page tables are frames of the simulated physical memory, like on real hardware: a table of
+ * _tablesize entries fills a frame exactly. The pool starts with a reserved block of frames
+ * and grows from the buddy allocator; free tables are linked through their first entry. */
+void table_pool_init() {
+	_table_live = (uint16_t*)calloc(_pagenum, sizeof(uint16_t));
+	if(_table_live == NULL) {
+		fprintf(stderr, "calloc for _table_live fails!\n");
+		exit(1);
+	}
+	uint32_t order = get_pow2(_pagenum>>TABLE_RESERVE_SHIFT);
+	pageno_t ppn = buddy_alloc(order);
+	if(ppn == BUDDY_NIL) {
+		fprintf(stderr, "no frames for the page table pool!\n");
+		exit(1);
+	}
+	table_pool_add(ppn, 1ULL<<order);
 }
 
-void set_bitmap(uint32_t *bitmap, uint64_t k) {
-	bitmap[k>>5] |= (1<<(k&(~((~0)<<5))));
+// hand frames [ppn, ppn+num) to the pool, they are popped in ascending order
+void table_pool_add(pageno_t ppn, uint64_t num) {
+	for(uint64_t k=num;k>0;--k)	table_free((address_t*)(transfer_ppntopfn(ppn+k-1)<<_offsetbits));
 }
 
-void clear_bitmap(uint32_t *bitmap, uint64_t k) {
-	bitmap[k>>5] &= ~(1<<(k&(~((~0)<<5))));
+// take up to TABLE_POOL_BATCH more frames for the pool, takes _frame_lock. False when none is left
+bool table_pool_grow() {
+	pageno_t ppn;
+	pthread_mutex_lock(&_frame_lock);
+	uint64_t run = buddy_alloc_run(TABLE_POOL_BATCH, &ppn);
+	pthread_mutex_unlock(&_frame_lock);
+	if(run == 0) {
+		frame_cache_reclaim();
+		pthread_mutex_lock(&_frame_lock);
+		run = buddy_alloc_run(TABLE_POOL_BATCH, &ppn);
+		pthread_mutex_unlock(&_frame_lock);
+	}
+	// in swap mode a table may take the frame of an evicted page
+	if(run==0 && _swapon && (ppn=swap_evict())!=BUDDY_NIL)	run = 1;
+	if(run == 0)	return false;
+	table_pool_add(ppn, run);
+	return true;
 }
 
-bool get_bitmap(uint32_t *bitmap, uint64_t k) {
-	if((bitmap[k>>5]>>(k&~((~0)<<5))) & 1)	return true;
-	else	return false;
+/* Make sure the pool holds the tables mapping [vpn, vpn+num_pages) could need, so that
+ * page_map() does not have to grow it while the caller holds _frame_lock. False when the
+ * frames for them are not there. */
+bool table_reserve(pageno_t vpn, uint64_t num_pages) {
+	pageno_t last = vpn+num_pages-1;
+	uint64_t need = 0;
+	for(uint32_t level=1;level<=3;++level)
+		need += (last>>(level*LEVELBITS)) - (vpn>>(level*LEVELBITS)) + 1;
+	while(_table_freenum < need)
+		if(!table_pool_grow())	return false;
+	return true;
 }
 
-uint32_t get_pageoffset(address_t va) {
-	return va & ~((~0)<<_offsetbits);
+/* A zeroed page table, NULL when the pool is empty and cannot grow. The pool is only used
+ * with _pagetable_lock held for writing (or by the single threaded a_malloc/a_free), so
+ * taking a table is a pointer pop. */
+address_t *table_alloc() {
+	if(_table_free==NULL && !table_pool_grow())	return NULL;
+	address_t *table = _table_free;
+	_table_free = (address_t*)table[0];
+	--_table_freenum;
+	memset(table, 0, _tablesize*sizeof(address_t));
+	*table_live(table) = 0;
+	__atomic_add_fetch(&_table_used, 1, __ATOMIC_RELAXED);
+	return table;
 }
 
-uint32_t get_pgdindex(address_t va) {
-	return va >> (_offsetbits + 3*LEVELBITS);
+void table_free(address_t *table) {
+	table[0] = (address_t)_table_free;
+	_table_free = table;
+	++_table_freenum;
 }
 
-uint32_t get_pudindex(address_t va) {
-	return (va >> (_offsetbits + 2*LEVELBITS)) & ~((~0)<<LEVELBITS);
+// the number of live entries of a table is kept in a side array indexed by its frame
+uint16_t *table_live(address_t *table) {
+	return &_table_live[transfer_pfntoppn((address_t)table>>_offsetbits)];
 }
 
-uint32_t get_pmdindex(address_t va) {
-	return (va >> (_offsetbits + LEVELBITS)) & ~((~0)<<LEVELBITS);
+// back to the pool once no walker can reach the table any more
+void table_retire(address_t *table) {
+	ebr_retire(table);
 }
 
-uint32_t get_pteindex(address_t va) {
-	return (va>>_offsetbits) & ~((~0)<<LEVELBITS);
+/* Back the reserved page vpn with a frame: a page of a lazy allocation gets a zeroed frame
+ * on its first write, a swapped out page is read back from the swap file on any access, and
+ * a write to a page shared with a clone gets a copy of the page. In swap mode a frame is
+ * evicted when memory is full. Returns false when vpn is not reserved or no frame can be
+ * found. */
+bool page_fault(pageno_t vpn, bool write, bool threadsafe) {
+	VM_COUNT(page_faults, 1);
+	if(threadsafe)	hold_wlock(&_pagetable_lock);
+	bool backed = page_fault_locked(vpn, write);
+	if(threadsafe)	release_lock(&_pagetable_lock);
+	return backed;
 }
 
-uint32_t get_pow2(uint64_t number) {
-	uint32_t counter = 0;
-	number >>= 1;
-	while(number) {
-		++counter;
-		number >>= 1;
+// page_fault() with _pagetable_lock held for writing
+bool page_fault_locked(pageno_t vpn, bool write) {
+	vm_context *ctx = vm_current();
+	if(!get_bitmap(ctx->vbitmap, vpn))	return false;
+	pageno_t pfn = pt_walk(vpn, NULL), tag = vm_tag(ctx, vpn);
+	// another thread backed the page first
+	if(pfn!=0 && !(write && (pfn & PTE_READONLY)))	return true;
+	pte_t *pte = pte_lookup(ctx, vpn);
+	pte_t entry = pte==NULL ? 0 : *pte;
+	pageno_t shared = transfer_pfntoppn(pfn & PTE_PFNMASK);
+	if(pfn!=0 && _frame_ref[shared]==0) {
+		// the clones of the page have gone, the last sharer keeps the frame
+		__atomic_store_n(pte, entry & ~PTE_READONLY, __ATOMIC_RELEASE);
+		tlb_freeupdate(tag, false);
+		native_drop(tag, 1);
+		_frame_vpn[shared] = tag;
+		return true;
 	}
-	return counter;
-}
 
-pageno_t transfer_ppntopfn(pageno_t ppn) {
-	return (((address_t)memstart)>>_offsetbits) + ppn;
+	// the tables of a fresh page come before its frame, which is not taken back when they fail
+	if(pte==NULL && !table_reserve(vpn, 1)) {
+		fault_error("page_fault for vpn=", vpn, ": out of physical memory for page tables!\n");
+		return false;
+	}
+	pageno_t ppn = page_frame();
+	if(ppn == BUDDY_NIL) {
+		fault_error("page_fault for vpn=", vpn, ": out of physical memory!\n");
+		return false;
+	}
+	pageno_t newpfn = transfer_ppntopfn(ppn);
+	void *frame = (void*)(newpfn<<_offsetbits);
+	if(pfn != 0) {
+		memcpy(frame, (void*)((pfn & PTE_PFNMASK)<<_offsetbits), PGSIZE);
+		--_frame_ref[shared];
+		__atomic_store_n(pte, newpfn, __ATOMIC_RELEASE);
+		_frame_vpn[ppn] = tag;
+		tlb_freeupdate(tag, false);
+		native_drop(tag, 1);
+		// reads through the old translation end before the last sharer may write the frame
+		ebr_synchronize();
+	}else if(entry & PTE_SWAPPED) {
+		if(entry & PTE_COMPRESSED)	zswap_load(entry & PTE_PFNMASK, frame);
+		else	swap_io(entry & PTE_PFNMASK, frame, false);
+		swap_release(entry);
+		__atomic_store_n(pte, newpfn, __ATOMIC_RELEASE);
+		_frame_vpn[ppn] = tag;
+		++_swap_ins;
+	}else {
+		// a read in the native region may have mapped the zero page there
+		native_drop(tag, 1);
+		memset(frame, 0, PGSIZE);
+		if(page_map(vpn, newpfn) == false) {
+			pthread_mutex_lock(&_frame_lock);
+			buddy_free(ppn, 0);
+			pthread_mutex_unlock(&_frame_lock);
+			return false;
+		}
+	}
+	return true;
 }
 
-pageno_t transfer_pfntoppn(pageno_t pfn) {
-	return pfn - ((address_t)memstart>>_offsetbits);
+/* A frame for a page fault, in swap mode a page is evicted when none is free. A thread
+ * without a frame cache, in the fault handler of native mode, takes it from the buddy
+ * allocator directly so that the handler does not allocate the cache. */
+pageno_t page_frame() {
+	pageno_t ppn = BUDDY_NIL;
+	if(_frame_local == NULL) {
+		for(int tries=0;tries<2 && ppn==BUDDY_NIL;++tries) {
+			if(tries > 0)	frame_cache_reclaim();
+			pthread_mutex_lock(&_frame_lock);
+			ppn = buddy_alloc(0);
+			pthread_mutex_unlock(&_frame_lock);
+		}
+		if(ppn != BUDDY_NIL)	return ppn;
+	}else if(frame_cache_get(1, &ppn))	return ppn;
+	if(_swapon)	return swap_evict();
+	return BUDDY_NIL;
 }
 
-uint64_t tlb_lookup(pageno_t vpn) {
-	uint32_t target = vpn & _tlbmodbits;
-	if(_tlb_store[target].key==vpn && _tlb_store[target].valid==true)	return _tlb_store[target].value;
-	return 0;
+// drop a mapping of frame ppn, the frame is freed with its last mapping
+void frame_put(pageno_t ppn) {
+	if(_frame_ref[ppn] > 0) {
+		--_frame_ref[ppn];
+		return;
+	}
+	_frame_vpn[ppn] = SWAP_NOVPN;
+	// host pointers from vm_pin() may still write the frame, its last vm_unpin() frees it
+	if(_frame_pin[ppn] != 0) {
+		_frame_pin[ppn] |= FRAME_PIN_FREED;
+		return;
+	}
+	frame_free(ppn);
 }
 
-void tlb_add(pageno_t vpn, pageno_t pfn) {
-	uint32_t target = vpn & _tlbmodbits;
-	_tlb_store[target].key = vpn;
-	_tlb_store[target].value = pfn;
-	_tlb_store[target].valid = true;
+// drop a pin of frame ppn, a frame whose page was freed meanwhile goes with its last pin
+void frame_unpin(pageno_t ppn) {
+	if(--_frame_pin[ppn] != FRAME_PIN_FREED)	return;
+	_frame_pin[ppn] = 0;
+	frame_free(ppn);
 }
 
-void tlb_freeupdate(pageno_t vpn) {
-	uint32_t target = vpn & _tlbmodbits;
-	if(_tlb_store[target].key==vpn && _tlb_store[target].valid==true)	_tlb_store[target].valid = false;
+/* Split the huge mapping holding vpn of ctx, if there is one, into 4K ptes over the same
+ * frames. False when no table is left for the split. */
+bool page_split(vm_context *ctx, pageno_t vpn) {
+	pud_t *pudtable = (pud_t*)ctx->pgd[vpn>>(3*LEVELBITS)];
+	pmd_t *pmdtable = pudtable==NULL ? NULL : (pmd_t*)pudtable[(vpn>>(2*LEVELBITS)) & (_tablesize-1)];
+	uint32_t pmdindex = (vpn>>LEVELBITS) & (_tablesize-1);
+	if(pmdtable==NULL || !(pmdtable[pmdindex] & PMD_HUGE))	return true;
+	return page_demote(pmdtable, pmdindex, vpn & ~(HUGE_PAGES-1));
 }
 
-void release_lock(pthread_rwlock_t *lock) {
-	if(0 != pthread_rwlock_unlock(lock)) {
-		fprintf(stderr, "pthread_rwlock_unlock(lock) fails!\n");
-		exit(1);
-	}
-}
+/* Map a copy on write clone of the pages holding [va, va+size) to a new range and return the
+ * address of va in it, NULL when a page is not allocated, no virtual range is free or a page
+ * cannot be backed; the pages cloned so far are unmapped again then. Both
+ * ranges share the frames through read-only ptes, _frame_ref counts the extra mappings of a
+ * frame, and the first write to a shared page copies just that page, see page_fault(). Pages
+ * of a lazy allocation that were never written stay unbacked in the clone. Swapped out pages
+ * are read back and huge mappings are split first; shared frames are not evicted. A frame
+ * pinned by vm_pin() is never shared, the clone gets a copy of its page right away. */
+void *vm_clone(void *va, uint64_t size) {
+	vm_context *ctx = vm_current();
+	uint32_t *vbitmap = ctx->vbitmap;
+	if(ctx->pgd==NULL || size==0 || size>MAX_VIRTSIZE)	return NULL;
+	va = (void*)vm_address(va);
+	pageno_t src = (address_t)va >> _offsetbits;
+	uint64_t num_pages = (((address_t)va+size-1) >> _offsetbits) - src + 1;
+	hold_wlock(&_pagetable_lock);
+	pageno_t dst = BITMAP_NOTFOUND;
+	for(pageno_t vpn=src;vpn<src+num_pages;++vpn)
+		if(vpn>=_vpagenum || get_bitmap(vbitmap, vpn)==0)	goto out;
+	dst = bitmap_find_run(vbitmap, num_pages, 1);
+	// the tables of the clone are reserved before any page is shared
+	if(dst!=BITMAP_NOTFOUND && !table_reserve(dst, num_pages))	dst = BITMAP_NOTFOUND;
+	if(dst == BITMAP_NOTFOUND)	goto out;
+	for(uint64_t k=0;k<num_pages;++k)	set_bitmap(vbitmap, dst+k);
+	bool failed = false;
+	for(uint64_t k=0;k<num_pages && !failed;++k) {
+		pageno_t vpn = src+k;
+		if(page_split(ctx, vpn) == false) {
+			failed = true;
+			break;
+		}
+		pte_t *pte = pte_lookup(ctx, vpn);
+		if(pte==NULL || *pte==0)	continue;
+		if((*pte & PTE_SWAPPED) && page_fault_locked(vpn, false)==false) {
+			failed = true;
+			break;
+		}
+		pageno_t ppn = transfer_pfntoppn(*pte & PTE_PFNMASK);
+		if(_frame_pin[ppn] != 0) {
+			pageno_t copy = page_frame();
+			if(copy == BUDDY_NIL) {
+				fprintf(stderr, "vm_clone for vpn=%"PRIu64": out of physical memory!\n", vpn);
+				failed = true;
+				break;
+			}
+			memcpy((void*)(transfer_ppntopfn(copy)<<_offsetbits), (void*)(transfer_ppntopfn(ppn)<<_offsetbits), PGSIZE);
+			if(page_map(dst+k, transfer_ppntopfn(copy)) == false) {
+				frame_free(copy);
+				failed = true;
+			}
+			continue;
+		}
+		// the source page is shared only once the clone maps it
+		if(page_map(dst+k, (*pte & PTE_PFNMASK) | PTE_READONLY) == false) {
+			failed = true;
+			break;
+		}
+		__atomic_fetch_or(pte, PTE_READONLY, __ATOMIC_ACQ_REL);
+		++_frame_ref[ppn];
+		_frame_vpn[ppn] = SWAP_NOVPN;
+	}
+	// drops the mappings made so far like a_free() of the clone, with the reservation
+	if(failed)	unmap_pages(dst, num_pages);
+	// writes through translations from before the clone end before it returns
+	tlb_freerange(vm_tag(ctx, src), num_pages);
+	native_drop(vm_tag(ctx, src), num_pages);
+	ebr_synchronize();
+	if(failed)	dst = BITMAP_NOTFOUND;
+out:
+	release_lock(&_pagetable_lock);
+	if(dst == BITMAP_NOTFOUND)	return NULL;
+	return vm_native((void*)((dst<<_offsetbits) | get_pageoffset((address_t)va)));
+}
+
+/* Pin the pages holding [va, va+len) to their frames, so that the range can be used through
+ * host pointers. Every page is backed first, a page shared with a clone gets its own copy and
+ * huge mappings are split, since frames are pinned one at a time. Until vm_unpin() the frames
+ * are not evicted, not shared by vm_clone(), and not reused when the range is freed. *ptr is
+ * the host address of va when the range lies in consecutive frames and NULL otherwise; the
+ * runs of the handle, also walked by vm_pin_next(), cover the range in order either way.
+ * Returns NULL when a page is not allocated or gets no frame. */
+vm_pinned *vm_pin(void *va, uint64_t len, void **ptr) {
+	vm_context *ctx = vm_current();
+	if(ptr != NULL)	*ptr = NULL;
+	if(ctx->pgd==NULL || len==0 || len>MAX_VIRTSIZE)	return NULL;
+	address_t addr = vm_address(va);
+	pageno_t start = addr >> _offsetbits;
+	uint64_t num_pages = ((addr+len-1) >> _offsetbits) - start + 1, k;
+	pageno_t *frames = (pageno_t*)malloc(num_pages*sizeof(pageno_t));
+	if(frames == NULL) {
+		fprintf(stderr, "malloc for pinned frames fails!\n");
+		exit(1);
+	}
+	hold_wlock(&_pagetable_lock);
+	for(k=0;k<num_pages;++k) {
+		pageno_t vpn = start+k;
+		// vpn 0 is marked in vbitmap but never allocated
+		if(vpn==0 || vpn>=_vpagenum || get_bitmap(ctx->vbitmap, vpn)==0)	break;
+		if(page_split(ctx, vpn) == false)	break;
+		pageno_t pfn = pt_walk(vpn, NULL);
+		if(pfn==0 || (pfn & PTE_READONLY)) {
+			if(page_fault_locked(vpn, true) == false)	break;
+			pfn = pt_walk(vpn, NULL);
+		}
+		frames[k] = transfer_pfntoppn(pfn & PTE_PFNMASK);
+		++_frame_pin[frames[k]];
+	}
+	if(k < num_pages) {
+		while(k > 0)	frame_unpin(frames[--k]);
+		release_lock(&_pagetable_lock);
+		free(frames);
+		return NULL;
+	}
+	release_lock(&_pagetable_lock);
+
+	uint32_t nruns = 1;
+	for(k=1;k<num_pages;++k)
+		if(frames[k] != frames[k-1]+1)	++nruns;
+	vm_pinned *pin = (vm_pinned*)malloc(sizeof(vm_pinned)+nruns*sizeof(vm_run));
+	if(pin == NULL) {
+		fprintf(stderr, "malloc for vm_pinned fails!\n");
+		exit(1);
+	}
+	pin->va = va;
+	pin->len = len;
+	pin->nruns = 0;
+	pin->next = 0;
+	uint64_t offset = get_pageoffset((address_t)va), left = len;
+	for(k=0;k<num_pages;++k) {
+		uint64_t chunk = PGSIZE-offset < left ? PGSIZE-offset : left;
+		address_t pa = (transfer_ppntopfn(frames[k])<<_offsetbits) + offset;
+		if(k>0 && frames[k]==frames[k-1]+1)	pin->runs[pin->nruns-1].len += chunk;
+		else {
+			pin->runs[pin->nruns].pa = pa;
+			pin->runs[pin->nruns].len = chunk;
+			++pin->nruns;
+		}
+		left -= chunk;
+		offset = 0;
+	}
+	free(frames);
+	if(ptr!=NULL && pin->nruns==1)	*ptr = (void*)pin->runs[0].pa;
+	return pin;
+}
+
+// the next run of a pinned range with its length in *len, NULL after the last one
+void *vm_pin_next(vm_pinned *pin, uint64_t *len) {
+	if(pin->next == pin->nruns)	return NULL;
+	vm_run *run = &pin->runs[pin->next++];
+	if(len != NULL)	*len = run->len;
+	return (void*)run->pa;
+}
+
+// release the frames of a range pinned by vm_pin() and the handle
+void vm_unpin(vm_pinned *pin) {
+	if(pin == NULL)	return;
+	hold_wlock(&_pagetable_lock);
+	for(uint32_t i=0;i<pin->nruns;++i) {
+		pageno_t first = pin->runs[i].pa>>_offsetbits, last = (pin->runs[i].pa+pin->runs[i].len-1)>>_offsetbits;
+		for(pageno_t pfn=first;pfn<=last;++pfn)	frame_unpin(transfer_pfntoppn(pfn));
+	}
+	release_lock(&_pagetable_lock);
+	free(pin);
+}
+
+/* Let umalloc() hand out host addresses that can be dereferenced directly. The default
+ * context is mirrored in a host region of MAX_VIRTSIZE bytes where nothing is mapped at first:
+ * the first access to a page faults (SIGSEGV), and the handler maps the frame of the page
+ * there, read only while it is shared with a clone, or the host zero page for a read of a page
+ * never written. Allocations only reserve their pages like ALLOC_LAZY. Swapping a page out,
+ * cloning it or freeing it unmaps it from the region again, and in swap mode the CLOCK hand
+ * unmaps a page when it clears its accessed bit, so the next access marks it again. Every
+ * call of the API takes native addresses as well as VM addresses, also as the host buffer of
+ * put_val()/get_val() and friends. System calls do not fault, they fail with EFAULT on a
+ * page not mapped yet.
+ * The frames are shared with children after fork(). Only has an effect before the first
+ * allocation. */
+void set_native_mode(bool enable) {
+	_native = enable;
+}
+
+/* Back memstart with a memfd so its frames can be mapped into the native region as well,
+ * reserve the region and install the fault handler. Called by set_physical_mem(). */
+void native_init() {
+	_native_fd = syscall(SYS_memfd_create, "my_vm", 0);
+	if(_native_fd<0 || ftruncate(_native_fd, MAX_MEMSIZE)!=0
+	   || mmap(memstart, MAX_MEMSIZE, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, _native_fd, 0)==MAP_FAILED) {
+		fprintf(stderr, "memfd for physical memory fails!\n");
+		exit(1);
+	}
+	_native_base = mmap(NULL, MAX_VIRTSIZE, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if(_native_base == MAP_FAILED) {
+		fprintf(stderr, "mmap for native region fails!\n");
+		exit(1);
+	}
+	_native_ro = bitmap_create(MAX_VIRTSIZE/PGSIZE);
+	// half of vm.max_map_count, the rest of the process may need mappings too
+	long maxmaps = 65530;
+	FILE *f = fopen("/proc/sys/vm/max_map_count", "r");
+	if(f != NULL) {
+		if(fscanf(f, "%ld", &maxmaps) != 1)	maxmaps = 65530;
+		fclose(f);
+	}
+	_native_maxmaps = maxmaps/2;
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = native_signal;
+	action.sa_flags = SA_SIGINFO;
+	sigemptyset(&action.sa_mask);
+	if(sigaction(SIGSEGV, &action, &_native_prev) != 0) {
+		fprintf(stderr, "sigaction for native mode fails!\n");
+		exit(1);
+	}
+}
+
+/* The native address of va, a VM address of the default context, in native mode. The
+ * allocating thread gets its frame cache and counter shard here, so that its faults on the
+ * memory do not allocate them in the fault handler. */
+void *vm_native(void *va) {
+	if(!_native || va==NULL || vm_current()!=&_vm_default)	return va;
+	frame_cache_current();
+	stats_local();
+	return _native_base + (address_t)va;
+}
+
+// the VM address of ptr when it points into the native region, ptr itself otherwise
+address_t vm_address(void *ptr) {
+	char *p = (char*)ptr;
+	if(_native && p>=_native_base && p<_native_base+MAX_VIRTSIZE)	return p-_native_base;
+	return (address_t)ptr;
+}
+
+/* SIGSEGV handler of native mode. A fault outside the region or on a page that is not
+ * allocated goes to the handler installed before, or takes the default action when the
+ * access is retried. */
+void native_signal(int signum, siginfo_t *info, void *context) {
+	char *addr = (char*)info->si_addr;
+	int saved = errno;
+	bool served = addr>=_native_base && addr<_native_base+MAX_VIRTSIZE && native_fault((addr-_native_base)>>_offsetbits);
+	errno = saved;
+	if(served)	return;
+	if(_native_prev.sa_flags & SA_SIGINFO)	_native_prev.sa_sigaction(signum, info, context);
+	else if(_native_prev.sa_handler!=SIG_DFL && _native_prev.sa_handler!=SIG_IGN)	_native_prev.sa_handler(signum);
+	else	signal(signum, SIG_DFL);
+}
+
+/* Serve a host fault on vpn of the native region in the default context. A fault on a page
+ * mapped read only can only be a write, which backs or copies the page through
+ * page_fault_locked() like put_val() would; any other fault maps what the page has now.
+ * Returns false when the page is not allocated or gets no frame. */
+bool native_fault(pageno_t vpn) {
+	// the thread is in a read section of the library, page_fault() could wait for itself
+	if(_ebr_local!=NULL && _ebr_local->depth>0) {
+		fault_error("native fault at vpn=", vpn, " inside the library fails!\n");
+		abort();
+	}
+	VM_COUNT(native_faults, 1);
+	vm_context *saved = _vm_current;
+	_vm_current = NULL;
+	hold_wlock(&_pagetable_lock);
+	bool write = get_bitmap(_native_ro, vpn);
+	bool served = vpn!=0 && get_bitmap(_vm_default.vbitmap, vpn);
+	if(served) {
+		pte_t *pte = pte_lookup(&_vm_default, vpn);
+		if(!write && (pte==NULL || *pte==0))	native_map(vpn, 0);
+		else if((served = page_fault_locked(vpn, write)))	native_map(vpn, pt_walk(vpn, NULL));
+	}
+	release_lock(&_pagetable_lock);
+	_vm_current = saved;
+	return served;
+}
+
+/* Write what, num in decimal and rest to stderr with write(2). The fault handler of native
+ * mode reports through this: the faulting thread may hold the lock of stderr, in fwrite()
+ * of a native buffer, and exit() would run the atexit handlers inside the handler. */
+void fault_error(const char *what, uint64_t num, const char *rest) {
+	char digits[20];
+	int n = sizeof(digits);
+	do {
+		digits[--n] = '0' + num%10;
+		num /= 10;
+	}while(num > 0);
+	ssize_t ret = write(STDERR_FILENO, what, strlen(what));
+	ret = write(STDERR_FILENO, digits+n, sizeof(digits)-n);
+	ret = write(STDERR_FILENO, rest, strlen(rest));
+	(void)ret;
+}
+
+// map pfn at vpn of the native region, read only with PTE_READONLY, the zero page for pfn 0
+void native_map(pageno_t vpn, pageno_t pfn) {
+	char *addr = _native_base + (vpn<<_offsetbits);
+	bool readonly = pfn==0 || (pfn & PTE_READONLY);
+	native_budget();
+	for(int tries=0;;++tries) {
+		void *mapped;
+		if(pfn == 0)	mapped = mmap(addr, PGSIZE, PROT_READ, MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0);
+		else	mapped = mmap(addr, PGSIZE, readonly ? PROT_READ : PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED,
+				_native_fd, transfer_pfntoppn(pfn & PTE_PFNMASK)<<_offsetbits);
+		if(mapped != MAP_FAILED)	break;
+		if(tries > 0) {
+			fault_error("mmap for native vpn=", vpn, " fails!\n");
+			_exit(1);
+		}
+		native_reset();
+	}
+	if(readonly)	set_bitmap(_native_ro, vpn);
+	else	clear_bitmap(_native_ro, vpn);
+}
+
+/* Unmap [tag, tag+num) from the native region, the next access faults. Only pages of the
+ * default context are mirrored there. Called with _pagetable_lock held for writing, before
+ * the frames of the pages are reused. */
+void native_drop(pageno_t tag, uint64_t num) {
+	if(!_native || (tag>>VM_ASID_SHIFT)!=0)	return;
+	native_budget();
+	if(mmap(_native_base+(tag<<_offsetbits), num<<_offsetbits, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED|MAP_NORESERVE, -1, 0) == MAP_FAILED) {
+		native_reset();
+		return;
+	}
+	for(pageno_t vpn=bitmap_next_set(_native_ro, tag);vpn<tag+num;vpn=bitmap_next_set(_native_ro, vpn+1))
+		clear_bitmap(_native_ro, vpn);
+}
+
+/* Called before each mmap call into the native region, which splits at most one host mapping
+ * in three. Pages mapped one at a time over scattered frames take a host mapping each, when
+ * the process gets near _native_maxmaps of them the region is emptied. The count is read
+ * with plain system calls, this runs in the fault handler. */
+void native_budget() {
+	if(++_native_ops < _native_slack)	return;
+	uint64_t maps = native_mapcount();
+	if(maps >= _native_maxmaps) {
+		native_reset();
+		maps = native_mapcount();
+	}
+	_native_slack = maps+2*NATIVE_MINSLACK<_native_maxmaps ? (_native_maxmaps-maps)/2 : NATIVE_MINSLACK;
+	_native_ops = 0;
+}
+
+// lines of /proc/self/maps, one per host mapping
+uint64_t native_mapcount() {
+	char buf[4096];
+	uint64_t lines = 0;
+	ssize_t n;
+	int fd = open("/proc/self/maps", O_RDONLY);
+	if(fd < 0)	return 0;
+	while((n = read(fd, buf, sizeof(buf))) > 0)
+		for(ssize_t i=0;i<n;++i)	lines += buf[i]=='\n';
+	close(fd);
+	return lines;
+}
+
+// unmap every page of the native region, which leaves a single host mapping for it
+void native_reset() {
+	int flags = MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED|MAP_NORESERVE;
+	// replacing the region needs no free host mapping, unless its ends were merged with neighbours
+	if(mmap(_native_base, MAX_VIRTSIZE, PROT_NONE, flags, -1, 0) == MAP_FAILED) {
+		munmap(_native_base, MAX_VIRTSIZE);
+		if(mmap(_native_base, MAX_VIRTSIZE, PROT_NONE, flags, -1, 0) != _native_base) {
+			fault_error("mmap for native region of ", MAX_VIRTSIZE, " bytes fails!\n");
+			_exit(1);
+		}
+	}
+	for(pageno_t vpn=bitmap_next_set(_native_ro, 0);vpn<_vpagenum;vpn=bitmap_next_set(_native_ro, vpn+1))
+		clear_bitmap(_native_ro, vpn);
+}
+
+/* Back the simulated memory with the swap file at path. When no frame is free, page_fault()
+ * evicts a page chosen by CLOCK over the pte accessed bits to the file, and the page is read
+ * back on its next access. Allocations made afterwards only reserve their pages like
+ * ALLOC_LAZY, so they may add up to MAX_VIRTSIZE. Huge mappings and page tables stay
+ * resident. Returns false when the file cannot be opened or a swap file is already set. */
+bool set_swap_file(const char *path) {
+	if(_swapfd >= 0)	return false;
+	int fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0600);
+	if(fd < 0)	return false;
+	if(_swap_slots == NULL)	_swap_slots = bitmap_create(MAX_VIRTSIZE/PGSIZE);
+	_swapfd = fd;
+	_swapon = true;
+	return true;
+}
+
+/* Keep evicted pages compressed in host memory, up to maxbytes of compressed data, before
+ * any go to the swap file. Pages that do not compress to ZSWAP_MAXSIZE, or do not fit the
+ * budget, go to the swap file, or stay resident without one. Turns swap mode on like
+ * set_swap_file(); a budget of 0 only stops further pages from being compressed. */
+void set_swap_compress(uint64_t maxbytes) {
+	if(_zswap_data == NULL && maxbytes > 0) {
+		_zswap_data = (uint8_t**)calloc(MAX_VIRTSIZE/PGSIZE, sizeof(uint8_t*));
+		if(_zswap_data == NULL) {
+			fprintf(stderr, "calloc for _zswap_data fails!\n");
+			exit(1);
+		}
+		if(_swap_slots == NULL)	_swap_slots = bitmap_create(MAX_VIRTSIZE/PGSIZE);
+		_swapon = true;
+	}
+	_zswap_max = maxbytes;
+}
+
+// whether the pte of vpn holds a swap slot
+bool page_swapped(pageno_t vpn) {
+	vm_context *ctx = vm_current();
+	if(!_swapon || ctx->pgd==NULL)	return false;
+	ebr_enter();
+	pte_t *pte = pte_lookup(ctx, vpn);
+	bool swapped = pte!=NULL && (__atomic_load_n(pte, __ATOMIC_ACQUIRE) & PTE_SWAPPED);
+	ebr_exit();
+	return swapped;
+}
+
+// bytes of the unbacked range [va, va+len) before its first swapped out page
+uint64_t swap_hole(address_t va, uint64_t len) {
+	if(!_swapon)	return len;
+	for(address_t page=va&~(address_t)(PGSIZE-1);page<va+len;page+=PGSIZE)
+		if(page_swapped(page>>_offsetbits))	return page<=va ? 0 : page-va;
+	return len;
+}
+
+// free the slot of a swapped out pte and its compressed copy
+void swap_release(pte_t entry) {
+	uint64_t slot = entry & PTE_PFNMASK;
+	if(entry & PTE_COMPRESSED) {
+		_zswap_bytes -= *(uint32_t*)_zswap_data[slot];
+		free(_zswap_data[slot]);
+		_zswap_data[slot] = NULL;
+	}
+	clear_bitmap(_swap_slots, slot);
+}
+
+/* Compress the page at frame into slot, false when the page compresses to more than
+ * ZSWAP_MAXSIZE bytes or does not fit the budget. The length is kept in front of the data. */
+bool zswap_store(uint64_t slot, void *frame) {
+	if(_zswap_data == NULL)	return false;
+	uint8_t buf[ZSWAP_MAXSIZE];
+	uint32_t len = lz_compress((uint8_t*)frame, PGSIZE, buf, ZSWAP_MAXSIZE);
+	if(len==0 || _zswap_bytes+len>_zswap_max) {
+		++_zswap_stats.rejected;
+		return false;
+	}
+	uint8_t *block = (uint8_t*)malloc(sizeof(uint32_t)+len);
+	if(block == NULL) {
+		fprintf(stderr, "malloc for a compressed page fails!\n");
+		exit(1);
+	}
+	*(uint32_t*)block = len;
+	memcpy(block+sizeof(uint32_t), buf, len);
+	_zswap_data[slot] = block;
+	_zswap_bytes += len;
+	++_zswap_stats.stored;
+	_zswap_stats.bytes_in += PGSIZE;
+	_zswap_stats.bytes_out += len;
+	return true;
+}
+
+// decompress slot into frame, timed for zswap_stats()
+void zswap_load(uint64_t slot, void *frame) {
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	uint8_t *block = _zswap_data[slot];
+	if(!lz_decompress(block+sizeof(uint32_t), *(uint32_t*)block, (uint8_t*)frame, PGSIZE)) {
+		fprintf(stderr, "decompression of slot=%"PRIu64" fails!\n", slot);
+		exit(1);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	++_zswap_stats.faults;
+	_zswap_stats.fault_ns += (end.tv_sec-start.tv_sec)*1000000000ULL + end.tv_nsec - start.tv_nsec;
+}
+
+// counters of the compressed tier, taken under the page table lock
+void zswap_stats(vm_zstats *stats) {
+	if(_init_physical)	hold_rlock(&_pagetable_lock);
+	*stats = _zswap_stats;
+	stats->pool_bytes = _zswap_bytes;
+	if(_init_physical)	release_lock(&_pagetable_lock);
+}
+
+/* LZ77 with LZ4 style sequences: a token with the literal count in the high nibble and the
+ * match length-LZ_MINMATCH in the low one, 15 meaning that bytes of 255 and a last smaller
+ * one follow, then the literals and a 2 byte little endian match offset. The last sequence
+ * has literals only. Returns the compressed length, 0 when it would exceed cap. */
+uint32_t lz_compress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t cap) {
+	uint32_t table[1<<LZ_HASHBITS];
+	memset(table, 0, sizeof(table));
+	uint32_t ip = 0, anchor = 0, op = 0;
+	while(ip+LZ_MINMATCH <= len) {
+		uint32_t seq, prev;
+		memcpy(&seq, src+ip, sizeof(seq));
+		uint32_t h = (seq*2654435761u) >> (32-LZ_HASHBITS);
+		uint32_t cand = table[h];
+		table[h] = ip;
+		memcpy(&prev, src+cand, sizeof(prev));
+		if(cand>=ip || prev!=seq) {
+			++ip;
+			continue;
+		}
+		uint32_t mlen = LZ_MINMATCH;
+		// 8 bytes at a time, the lowest differing byte of a little endian word ends the match
+		while(ip+mlen+8 <= len) {
+			uint64_t a, b;
+			memcpy(&a, src+cand+mlen, sizeof(a));
+			memcpy(&b, src+ip+mlen, sizeof(b));
+			if(a != b)	break;
+			mlen += 8;
+		}
+		while(ip+mlen<len && src[cand+mlen]==src[ip+mlen])	++mlen;
+		op = lz_emit(dst, op, cap, src+anchor, ip-anchor, ip-cand, mlen);
+		if(op == 0)	return 0;
+		ip += mlen;
+		anchor = ip;
+	}
+	return lz_emit(dst, op, cap, src+anchor, len-anchor, 0, 0);
+}
+
+// append a sequence at dst+op, a match length of 0 ends the block; the new length or 0 past cap
+uint32_t lz_emit(uint8_t *dst, uint32_t op, uint32_t cap, const uint8_t *lit, uint32_t nlit, uint32_t offset, uint32_t mlen) {
+	if((uint64_t)op + 1 + nlit/255+1 + nlit + 2 + mlen/255+1 > cap)	return 0;
+	uint32_t m = mlen==0 ? 0 : mlen-LZ_MINMATCH;
+	dst[op++] = (nlit<15 ? nlit : 15)<<4 | (m<15 ? m : 15);
+	if(nlit >= 15) {
+		uint32_t rest = nlit-15;
+		for(;rest>=255;rest-=255)	dst[op++] = 255;
+		dst[op++] = rest;
+	}
+	memcpy(dst+op, lit, nlit);
+	op += nlit;
+	if(mlen == 0)	return op;
+	dst[op++] = offset & 0xff;
+	dst[op++] = offset >> 8;
+	if(m >= 15) {
+		uint32_t rest = m-15;
+		for(;rest>=255;rest-=255)	dst[op++] = 255;
+		dst[op++] = rest;
+	}
+	return op;
+}
+
+// inverse of lz_compress(), false unless src decodes to exactly size bytes
+bool lz_decompress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t size) {
+	uint32_t ip = 0, op = 0;
+	while(ip < len) {
+		uint8_t token = src[ip++], b;
+		uint32_t nlit = token>>4, mlen = token&15;
+		if(nlit == 15)
+			do {
+				if(ip >= len)	return false;
+				nlit += b = src[ip++];
+			}while(b == 255);
+		if(nlit>len-ip || nlit>size-op)	return false;
+		memcpy(dst+op, src+ip, nlit);
+		ip += nlit;
+		op += nlit;
+		if(ip == len)	break;
+		if(len-ip < 2)	return false;
+		uint32_t offset = src[ip] | src[ip+1]<<8;
+		ip += 2;
+		if(mlen == 15)
+			do {
+				if(ip >= len)	return false;
+				mlen += b = src[ip++];
+			}while(b == 255);
+		mlen += LZ_MINMATCH;
+		if(offset==0 || offset>op || mlen>size-op)	return false;
+		// a match may overlap its own output. Its bytes repeat every offset, so for a short
+		// offset, past the first stride bytes with stride a multiple of both offset and 8, 8 are
+		// copied at a time from where an earlier copy stored them
+		uint32_t stride = offset, k = 0;
+		if(offset < 8) {
+			while(stride%8 != 0)	stride += offset;
+			for(;k<stride && k<mlen;++k)	dst[op+k] = dst[op+k-offset];
+		}
+		for(;k+8<=mlen;k+=8)	memcpy(dst+op+k, dst+op+k-stride, 8);
+		for(;k<mlen;++k)	dst[op+k] = dst[op+k-offset];
+		op += mlen;
+	}
+	return op == size;
+}
+
+void swap_io(uint64_t slot, void *frame, bool write) {
+	ssize_t done = write ? pwrite(_swapfd, frame, PGSIZE, slot*PGSIZE) : pread(_swapfd, frame, PGSIZE, slot*PGSIZE);
+	if(done != PGSIZE) {
+		fprintf(stderr, "swap %s of slot=%"PRIu64" fails!\n", write ? "write" : "read", slot);
+		exit(1);
+	}
+}
+
+/* Evict a page of any context and return its frame, BUDDY_NIL when no frame backs an
+ * unpinned 4K page.
+ * The CLOCK hand sweeps _frame_vpn: a page whose accessed bit is set loses the bit and is
+ * passed over once. The pte of the victim gets a swap slot and the TLBs are shot down; the frame is only
+ * compressed or written out once every read section that could still copy through the old
+ * translation has ended. Called with _pagetable_lock held for writing, from outside any read section. */
+pageno_t swap_evict() {
+	for(uint64_t scanned=0;scanned<2*_pagenum;++scanned) {
+		pageno_t ppn = _swap_hand;
+		if(++_swap_hand == _pagenum)	_swap_hand = 0;
+		pageno_t tag = _frame_vpn[ppn];
+		if(tag==SWAP_NOVPN || _frame_pin[ppn]!=0)	continue;
+		pte_t *pte = pte_lookup(_vm_contexts[tag>>VM_ASID_SHIFT], tag & VM_VPNMASK);
+		pte_t entry = __atomic_load_n(pte, __ATOMIC_ACQUIRE);
+		if(entry & PTE_ACCESSED) {
+			__atomic_fetch_and(pte, ~PTE_ACCESSED, __ATOMIC_RELAXED);
+			// accesses through the native region only set the bit again by faulting
+			native_drop(tag, 1);
+			continue;
+		}
+		uint64_t slot = bitmap_next_clear(_swap_slots, 0);
+		if(slot == BITMAP_NOTFOUND)	return BUDDY_NIL;
+		// fails when a walker set the accessed bit meanwhile
+		if(!__atomic_compare_exchange_n(pte, &entry, slot|PTE_SWAPPED, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))	continue;
+		set_bitmap(_swap_slots, slot);
+		tlb_freeupdate(tag, false);
+		native_drop(tag, 1);
+		ebr_synchronize();
+		void *frame = (void*)(transfer_ppntopfn(ppn)<<_offsetbits);
+		if(zswap_store(slot, frame))	__atomic_fetch_or(pte, PTE_COMPRESSED, __ATOMIC_RELAXED);
+		else if(_swapfd >= 0)	swap_io(slot, frame, true);
+		else {
+			// nowhere to put the page, it stays and is passed over next time
+			clear_bitmap(_swap_slots, slot);
+			__atomic_store_n(pte, entry|PTE_ACCESSED, __ATOMIC_RELEASE);
+			continue;
+		}
+		_frame_vpn[ppn] = SWAP_NOVPN;
+		++_swap_outs;
+		return ppn;
+	}
+	return BUDDY_NIL;
+}
+
+// pages read back and evicted so far, through either tier
+void swap_stats(uint64_t *swapins, uint64_t *swapouts) {
+	if(swapins != NULL)	*swapins = __atomic_load_n(&_swap_ins, __ATOMIC_RELAXED);
+	if(swapouts != NULL)	*swapouts = __atomic_load_n(&_swap_outs, __ATOMIC_RELAXED);
+}
+
+/* Copy size bytes between va and val, one memcpy per run of contiguous frames from
+ * translate_range(). A page reserved by a lazy allocation but never written reads as zeros
+ * and gets its frame on the first write, a swapped out page is read back on any access. The
+ * thread safe version holds a read section while a batch of runs is being copied. */
+void copy_value(void *va, void *val, int size, bool write, bool threadsafe) {
+	vm_context *ctx = vm_current();
+	if(size<=0 || val==NULL || ctx->pgd==NULL)	return;
+	va = (void*)vm_address(va);
+	pageno_t vpn_start = (address_t)va >> _offsetbits;
+	pageno_t vpn_end = ((address_t)va + size-1) >> _offsetbits;
+
+	// check the validation first!
+	for(pageno_t vpn=vpn_start;vpn<=vpn_end;++vpn)
+		if(get_bitmap(ctx->vbitmap, vpn)==0)	return;
+
+	// a fault on native memory cannot be served inside a read section, a native buffer is
+	// copied through a bounce buffer outside of it
+	if(threadsafe && vm_address(val)!=(address_t)val) {
+		char bounce[COPY_BOUNCE];
+		for(int done=0;done<size;done+=COPY_BOUNCE) {
+			int len = size-done<COPY_BOUNCE ? size-done : COPY_BOUNCE;
+			memcpy(bounce, (char*)val+done, len);
+			copy_value((char*)va+done, bounce, len, write, true);
+			if(!write)	memcpy((char*)val+done, bounce, len);
+		}
+		return;
+	}
+
+	address_t addr = (address_t)va;
+	char *buf = (char*)val;
+	vm_run runs[COPY_RUNS];
+	while(size > 0) {
+		if(threadsafe)	ebr_enter();
+		uint32_t n = translate_range_quiet(addr, size, runs, COPY_RUNS, write, threadsafe), i;
+		uint64_t done = 0;
+		for(i=0;i<n;++i) {
+			uint64_t len = runs[i].len;
+			if(runs[i].pa == 0) {
+				if(write)	break;
+				len = swap_hole(addr+done, len);
+				memset(buf+done, 0, len);
+			}else if(write)	memcpy((void*)runs[i].pa, buf+done, len);
+			else	memcpy(buf+done, (void*)runs[i].pa, len);
+			done += len;
+			if(len < runs[i].len)	break;
+		}
+		if(threadsafe)	ebr_exit();
+		addr += done;
+		buf += done;
+		size -= done;
+		// a write reached an unbacked or shared page, or a read a swapped out one
+		if(i<n && page_fault(addr>>_offsetbits, write, threadsafe)==false)	return;
+	}
+}
+
+/* The function copies data pointed by "val" to physical
+ * memory pages using virtual address (va)
+*/
+void put_value(void *va, void *val, int size) {
+    /* HINT: Using the virtual address and translate(), find the physical page. Copy
+       the contents of "val" to a physical page. NOTE: The "size" value can be larger
+       than one page. Therefore, you may have to find multiple pages using translate()
+       function.*/
+	copy_value(va, val, size, true, false);
+}
+
+void put_val(void *va, void *val, int size) {
+	copy_value(va, val, size, true, true);
+}
+
+/*Given a virtual address, this function copies the contents of the page to val*/
+void get_value(void *va, void *val, int size) {
+    /* HINT: put the values pointed to by "va" inside the physical memory at given
+    "val" address. Assume you can access "val" directly by derefencing them.
+    If you are implementing TLB,  always check first the presence of translation in TLB before proceeding forward */
+	copy_value(va, val, size, false, false);
+}
+
+void get_val(void *va, void *val, int size) {
+	copy_value(va, val, size, false, true);
+}
+
+/* Stable LSD radix sort of m entries by vpn, 8 bits per pass over the bits that differ
+ * between the smallest and largest vpn. Returns whichever of order/tmp holds the result. */
+vm_iosort *iosort_radix(vm_iosort *order, vm_iosort *tmp, int m, pageno_t minvpn, pageno_t maxvpn) {
+	uint32_t count[256];
+	for(uint32_t shift=0;shift<64 && ((maxvpn-minvpn)>>shift)!=0;shift+=8) {
+		memset(count, 0, sizeof(count));
+		for(int i=0;i<m;++i)	++count[((order[i].vpn-minvpn)>>shift) & 255];
+		for(uint32_t d=0,sum=0;d<256;++d) {
+			uint32_t c = count[d];
+			count[d] = sum;
+			sum += c;
+		}
+		for(int i=0;i<m;++i)	tmp[count[((order[i].vpn-minvpn)>>shift) & 255]++] = order[i];
+		vm_iosort *swap = order;
+		order = tmp;
+		tmp = swap;
+	}
+	return order;
+}
+
+/* Copy a batch of accesses. Entries within one page are grouped by vpn, so each distinct page
+ * is checked and translated once and the whole batch runs in a single read section. Entries
+ * spanning pages, and in the thread safe version entries with a native buffer, go through
+ * copy_value() first. Entries on the same page are applied in batch order, the order of
+ * overlapping writes on different pages is unspecified. */
+void copy_valuev(vm_iovec *iov, int n, bool write, bool threadsafe) {
+	vm_context *ctx = vm_current();
+	if(n<=0 || iov==NULL || ctx->pgd==NULL)	return;
+	vm_iosort stackorder[2*IOV_STACK], *order = stackorder;
+	if(n > IOV_STACK) {
+		order = (vm_iosort*)malloc(2*n*sizeof(vm_iosort));
+		if(order == NULL) {
+			fprintf(stderr, "malloc for batch order fails!\n");
+			exit(1);
+		}
+	}
+	vm_iosort *buffer = order;
+	int m = 0;
+	bool sorted = true;
+	pageno_t minvpn = BITMAP_NOTFOUND, maxvpn = 0;
+	for(int k=0;k<n;++k) {
+		if(iov[k].size<=0 || iov[k].buf==NULL)	continue;
+		address_t va = vm_address(iov[k].va);
+		pageno_t vpn = va >> _offsetbits;
+		if(vpn!=(va + iov[k].size-1) >> _offsetbits || (threadsafe && vm_address(iov[k].buf)!=(address_t)iov[k].buf)) {
+			copy_value(iov[k].va, iov[k].buf, iov[k].size, write, threadsafe);
+			continue;
+		}
+		if(m>0 && order[m-1].vpn>vpn)	sorted = false;
+		if(vpn < minvpn)	minvpn = vpn;
+		if(vpn > maxvpn)	maxvpn = vpn;
+		order[m].vpn = vpn;
+		order[m].index = k;
+		++m;
+	}
+	if(!sorted)	order = iosort_radix(order, order+(n>IOV_STACK ? n : IOV_STACK), m, minvpn, maxvpn);
+
+	pageno_t vpn = BITMAP_NOTFOUND;
+	address_t frame = 0;
+	bool valid = false;
+	if(threadsafe)	ebr_enter();
+	for(int i=0;i<m;++i) {
+		if(order[i].vpn != vpn) {
+			vpn = order[i].vpn;
+			valid = vpn<_vpagenum && get_bitmap(ctx->vbitmap, vpn);
+			frame = valid ? translate_quiet(vpn<<_offsetbits, write, threadsafe) : 0;
+			if(valid && frame==0 && (write || page_swapped(vpn))) {
+				// the first write to a page of a lazy allocation or a shared page, or a swapped out
+				// page, page_fault() takes the page table lock
+				if(threadsafe)	ebr_exit();
+				valid = page_fault(vpn, write, threadsafe);
+				if(threadsafe)	ebr_enter();
+				frame = valid ? translate_quiet(vpn<<_offsetbits, write, threadsafe) : 0;
+				valid = frame != 0;
+			}
+		}
+		if(!valid)	continue;
+		vm_iovec *e = &iov[order[i].index];
+		address_t pa = frame + get_pageoffset((address_t)e->va);
+		if(frame == 0)	memset(e->buf, 0, e->size);
+		else if(write)	memcpy((void*)pa, e->buf, e->size);
+		else	memcpy(e->buf, (void*)pa, e->size);
+	}
+	if(threadsafe)	ebr_exit();
+	if(buffer != stackorder)	free(buffer);
+}
+
+// thread safe batch of put_val() calls
+void put_valv(vm_iovec *iov, int n) {
+	copy_valuev(iov, n, true, true);
+}
+
+// thread safe batch of get_val() calls
+void get_valv(vm_iovec *iov, int n) {
+	copy_valuev(iov, n, false, true);
+}
+
+/*
+This function receives two matrices mat1 and mat2 as an argument with size
+argument representing the number of rows and columns. After performing matrix multiplication, copy the result to answer.
+*/
+void mat_mult(void *mat1, void *mat2, int size, void *answer) {
+    /* Hint: You will index as [i * size + j] where  "i, j" are the indices of the
+    matrix accessed. Similar to the code in test.c, you will use get_value() to
+    load each element and perform multiplication. Take a look at test.c! In addition to 
+    getting the values from two matrices, you will perform multiplication and store the result to the "answer array"*/
+	mat_mult_tiled(mat1, mat2, size, answer, false);
+}
+
+/* Split answer into MAT_TILE x MAT_TILE tiles and compute them on the thread pool. Every
+ * worker starts with a contiguous share of the tiles and steals from the others when it runs
+ * out, the calling thread steals too until the last tile is taken. */
+void p_mat_mult(void *mat1, void *mat2, int size, void *answer) {
+	if(size <= 0)	return;
+	pool_start();
+	mat_job job;
+	job.mat1 = mat1;
+	job.mat2 = mat2;
+	job.answer = answer;
+	job.size = size;
+	job.ctx = vm_current();
+	job.tilecols = (size+MAT_TILE-1)/MAT_TILE;
+	job.kernel = mat_select_kernel();
+	uint32_t tiles = job.tilecols*job.tilecols;
+	job.remaining = tiles;
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_cond_init(&job.done, NULL);
+
+	pthread_mutex_lock(&_pool_lock);
+	uint32_t workers = _pool_running;
+	// counted before they are queued, workers take tasks without _pool_lock
+	__atomic_add_fetch(&_pool_pending, tiles, __ATOMIC_RELAXED);
+	for(uint32_t w=0;w<workers;++w)
+		for(uint32_t t=(uint64_t)tiles*w/workers;t<(uint64_t)tiles*(w+1)/workers;++t) {
+			pool_task task = {&job, t};
+			pool_push(w, task);
+		}
+	pthread_cond_broadcast(&_pool_cond);
+	pthread_mutex_unlock(&_pool_lock);
+
+	pool_task task;
+	while(__atomic_load_n(&job.remaining, __ATOMIC_ACQUIRE)!=0 && pool_take(-1, &task))	pool_run(task);
+	pthread_mutex_lock(&job.lock);
+	while(__atomic_load_n(&job.remaining, __ATOMIC_ACQUIRE) != 0)	pthread_cond_wait(&job.done, &job.lock);
+	pthread_mutex_unlock(&job.lock);
+	pthread_mutex_destroy(&job.lock);
+	pthread_cond_destroy(&job.done);
+}
+
+/* answer = mat1*mat2 one MAT_TILE x MAT_TILE tile of answer at a time, with sums that wrap
+ * around like the int arithmetic of the element by element version, so the results are
+ * identical. */
+void mat_mult_tiled(void *mat1, void *mat2, int size, void *answer, bool threadsafe) {
+	if(size <= 0)	return;
+	mat_kernel_t kernel = mat_select_kernel();
+	for(int ib=0;ib<size;ib+=MAT_TILE)
+		for(int jb=0;jb<size;jb+=MAT_TILE)
+			mat_mult_tile(mat1, mat2, size, answer, ib, jb, kernel, threadsafe);
+}
+
+/* Compute the tile of answer at row ib, column jb: the tiles of mat1 and mat2 it needs are
+ * copied out row by row, each row segment one copy_value(), multiplied by the kernel and the
+ * finished tile is written back the same way. */
+void mat_mult_tile(void *mat1, void *mat2, int size, void *answer, int ib, int jb, mat_kernel_t kernel, bool threadsafe) {
+	int a[MAT_TILE*MAT_TILE] __attribute__((aligned(32)));
+	int b[MAT_TILE*MAT_TILE] __attribute__((aligned(32)));
+	int c[MAT_TILE*MAT_TILE] __attribute__((aligned(32)));
+	int rows = size-ib < MAT_TILE ? size-ib : MAT_TILE;
+	int width = size-jb < MAT_TILE ? size-jb : MAT_TILE;
+	// the kernel works on whole vectors: columns of b between width and cols hold stale values,
+	// they only reach columns of c that are not written back
+	int cols = (width+7) & ~7;
+	memset(c, 0, sizeof(c));
+	for(int kb=0;kb<size;kb+=MAT_TILE) {
+		int depth = size-kb < MAT_TILE ? size-kb : MAT_TILE;
+		for(int i=0;i<rows;++i)
+			copy_value((char*)mat1 + ((uint64_t)(ib+i)*size+kb)*sizeof(int), &a[i*MAT_TILE], depth*sizeof(int), false, threadsafe);
+		for(int k=0;k<depth;++k)
+			copy_value((char*)mat2 + ((uint64_t)(kb+k)*size+jb)*sizeof(int), &b[k*MAT_TILE], width*sizeof(int), false, threadsafe);
+		kernel(a, b, c, rows, depth, cols);
+	}
+	for(int i=0;i<rows;++i)
+		copy_value((char*)answer + ((uint64_t)(ib+i)*size+jb)*sizeof(int), &c[i*MAT_TILE], width*sizeof(int), true, threadsafe);
+}
+
+// the widest kernel the CPU supports
+mat_kernel_t mat_select_kernel() {
+#ifdef MAT_SIMD
+	if(__builtin_cpu_supports("avx2"))	return mat_kernel_avx2;
+	if(__builtin_cpu_supports("sse4.1"))	return mat_kernel_sse41;
+#endif
+	return mat_kernel_scalar;
+}
+
+void mat_kernel_scalar(const int *a, const int *b, int *c, int rows, int depth, int cols) {
+	for(int i=0;i<rows;++i)
+		for(int k=0;k<depth;++k) {
+			uint32_t aik = a[i*MAT_TILE+k];
+			for(int j=0;j<cols;++j)
+				c[i*MAT_TILE+j] = (uint32_t)c[i*MAT_TILE+j] + aik*(uint32_t)b[k*MAT_TILE+j];
+		}
+}
+
+#ifdef MAT_SIMD
+__attribute__((target("sse4.1")))
+void mat_kernel_sse41(const int *a, const int *b, int *c, int rows, int depth, int cols) {
+	for(int i=0;i<rows;++i)
+		for(int j=0;j<cols;j+=8) {
+			__m128i c0 = _mm_loadu_si128((__m128i*)&c[i*MAT_TILE+j]);
+			__m128i c1 = _mm_loadu_si128((__m128i*)&c[i*MAT_TILE+j+4]);
+			for(int k=0;k<depth;++k) {
+				__m128i aik = _mm_set1_epi32(a[i*MAT_TILE+k]);
+				c0 = _mm_add_epi32(c0, _mm_mullo_epi32(aik, _mm_loadu_si128((__m128i*)&b[k*MAT_TILE+j])));
+				c1 = _mm_add_epi32(c1, _mm_mullo_epi32(aik, _mm_loadu_si128((__m128i*)&b[k*MAT_TILE+j+4])));
+			}
+			_mm_storeu_si128((__m128i*)&c[i*MAT_TILE+j], c0);
+			_mm_storeu_si128((__m128i*)&c[i*MAT_TILE+j+4], c1);
+		}
+}
+
+// four rows of c are kept in registers for every 8 columns, so each vector of b is loaded once per four rows
+__attribute__((target("avx2")))
+void mat_kernel_avx2(const int *a, const int *b, int *c, int rows, int depth, int cols) {
+	int i = 0;
+	for(;i+4<=rows;i+=4)
+		for(int j=0;j<cols;j+=8) {
+			__m256i c0 = _mm256_loadu_si256((__m256i*)&c[i*MAT_TILE+j]);
+			__m256i c1 = _mm256_loadu_si256((__m256i*)&c[(i+1)*MAT_TILE+j]);
+			__m256i c2 = _mm256_loadu_si256((__m256i*)&c[(i+2)*MAT_TILE+j]);
+			__m256i c3 = _mm256_loadu_si256((__m256i*)&c[(i+3)*MAT_TILE+j]);
+			for(int k=0;k<depth;++k) {
+				__m256i bkj = _mm256_loadu_si256((__m256i*)&b[k*MAT_TILE+j]);
+				c0 = _mm256_add_epi32(c0, _mm256_mullo_epi32(_mm256_set1_epi32(a[i*MAT_TILE+k]), bkj));
+				c1 = _mm256_add_epi32(c1, _mm256_mullo_epi32(_mm256_set1_epi32(a[(i+1)*MAT_TILE+k]), bkj));
+				c2 = _mm256_add_epi32(c2, _mm256_mullo_epi32(_mm256_set1_epi32(a[(i+2)*MAT_TILE+k]), bkj));
+				c3 = _mm256_add_epi32(c3, _mm256_mullo_epi32(_mm256_set1_epi32(a[(i+3)*MAT_TILE+k]), bkj));
+			}
+			_mm256_storeu_si256((__m256i*)&c[i*MAT_TILE+j], c0);
+			_mm256_storeu_si256((__m256i*)&c[(i+1)*MAT_TILE+j], c1);
+			_mm256_storeu_si256((__m256i*)&c[(i+2)*MAT_TILE+j], c2);
+			_mm256_storeu_si256((__m256i*)&c[(i+3)*MAT_TILE+j], c3);
+		}
+	for(;i<rows;++i)
+		for(int j=0;j<cols;j+=8) {
+			__m256i c0 = _mm256_loadu_si256((__m256i*)&c[i*MAT_TILE+j]);
+			for(int k=0;k<depth;++k)
+				c0 = _mm256_add_epi32(c0, _mm256_mullo_epi32(_mm256_set1_epi32(a[i*MAT_TILE+k]), _mm256_loadu_si256((__m256i*)&b[k*MAT_TILE+j])));
+			_mm256_storeu_si256((__m256i*)&c[i*MAT_TILE+j], c0);
+		}
+}
+#endif
+
+/* Allocate a bitmap of nbits clear bits together with its summary levels. Every bitmap
+ * passed to set_bitmap()/clear_bitmap() must come from here. */
+uint32_t *bitmap_create(uint64_t nbits) {
+	uint64_t nwords = (nbits+31)>>5;
+	bitmap_index *index = (bitmap_index*)calloc(1, sizeof(bitmap_index)+nwords*sizeof(uint32_t));
+	if(index == NULL) {
+		fprintf(stderr, "calloc for bitmap fails!\n");
+		exit(1);
+	}
+	index->nbits = nbits;
+	index->nwords = nwords;
+	// level l has one bit per word of level l-1 (per 32 bit word of the bitmap for level 0), up to a single word
+	uint64_t below = nwords;
+	for(index->levels=0;index->levels<BITMAP_MAXLEVELS;++index->levels) {
+		uint64_t words = (below+63)>>6;
+		index->levelwords[index->levels] = words;
+		index->nonfull[index->levels] = (uint64_t*)calloc(words, sizeof(uint64_t));
+		index->nonempty[index->levels] = (uint64_t*)calloc(words, sizeof(uint64_t));
+		if(index->nonfull[index->levels]==NULL || index->nonempty[index->levels]==NULL) {
+			fprintf(stderr, "calloc for bitmap summary fails!\n");
+			exit(1);
+		}
+		below = words;
+		if(words == 1)	break;
+	}
+	++index->levels;
+	// the tail of the last word is never free
+	for(uint64_t k=nbits;k<(nwords<<5);++k)	index->bits[k>>5] |= 1U<<(k&31);
+	for(uint64_t w=0;w<nwords;++w)	bitmap_summarize(index, w);
+	return index->bits;
+}
+
+void bitmap_destroy(uint32_t *bitmap) {
+	bitmap_index *index = bitmap_get_index(bitmap);
+	for(uint32_t l=0;l<index->levels;++l) {
+		free(index->nonfull[l]);
+		free(index->nonempty[l]);
+	}
+	free(index);
+}
+
+bitmap_index *bitmap_get_index(uint32_t *bitmap) {
+	return (bitmap_index*)((char*)bitmap - offsetof(bitmap_index, bits));
+}
+
+// propagate the state of bitmap word w up through both summaries
+void bitmap_summarize(bitmap_index *index, uint64_t w) {
+	uint32_t word = index->bits[w];
+	bool nonfull = word != UINT32_MAX, nonempty = word != 0;
+	for(uint32_t l=0;l<index->levels;++l) {
+		uint64_t bit = 1ULL<<(w&63), parent = w>>6;
+		uint64_t full_word = index->nonfull[l][parent], empty_word = index->nonempty[l][parent];
+		uint64_t new_full = nonfull ? full_word|bit : full_word&~bit;
+		uint64_t new_empty = nonempty ? empty_word|bit : empty_word&~bit;
+		if(new_full==full_word && new_empty==empty_word)	break;
+		index->nonfull[l][parent] = new_full;
+		index->nonempty[l][parent] = new_empty;
+		nonfull = new_full != 0;
+		nonempty = new_empty != 0;
+		w = parent;
+	}
+}
+
+void set_bitmap(uint32_t *bitmap, uint64_t k) {
+	// readers of vbitmap do not hold _pagetable_lock, so the word is stored in one piece
+	__atomic_store_n(&bitmap[k>>5], bitmap[k>>5] | (1<<(k&(~((~0)<<5)))), __ATOMIC_RELAXED);
+	bitmap_summarize(bitmap_get_index(bitmap), k>>5);
+}
+
+void clear_bitmap(uint32_t *bitmap, uint64_t k) {
+	__atomic_store_n(&bitmap[k>>5], bitmap[k>>5] & ~(1<<(k&(~((~0)<<5)))), __ATOMIC_RELAXED);
+	bitmap_summarize(bitmap_get_index(bitmap), k>>5);
+}
+
+bool get_bitmap(uint32_t *bitmap, uint64_t k) {
+	// readers of vbitmap do not hold _pagetable_lock
+	if((__atomic_load_n(&bitmap[k>>5], __ATOMIC_RELAXED)>>(k&~((~0)<<5))) & 1)	return true;
+	else	return false;
+}
+
+/* First bitmap word at or after w whose summary bit is set: climb while the rest of the
+ * current summary word is empty, then descend with ctz. O(levels). */
+uint64_t bitmap_summary_next(bitmap_index *index, uint64_t **summary, uint64_t w) {
+	uint32_t l = 0;
+	for(;;) {
+		if((w>>6) >= index->levelwords[l])	return BITMAP_NOTFOUND;
+		uint64_t bits = summary[l][w>>6] & (~0ULL<<(w&63));
+		if(bits) {
+			w = (w & ~63ULL) + __builtin_ctzll(bits);
+			break;
+		}
+		if(++l == index->levels)	return BITMAP_NOTFOUND;
+		w = (w>>6)+1;
+	}
+	while(l > 0) {
+		--l;
+		w = (w<<6) + __builtin_ctzll(summary[l][w]);
+	}
+	return w;
+}
+
+// first clear bit at or after k
+uint64_t bitmap_next_clear(uint32_t *bitmap, uint64_t k) {
+	bitmap_index *index = bitmap_get_index(bitmap);
+	if(k >= index->nbits)	return BITMAP_NOTFOUND;
+	uint64_t w = k>>5;
+	uint32_t free_bits = ~bitmap[w] & (UINT32_MAX<<(k&31));
+	if(free_bits == 0) {
+		w = bitmap_summary_next(index, index->nonfull, w+1);
+		if(w == BITMAP_NOTFOUND)	return BITMAP_NOTFOUND;
+		free_bits = ~bitmap[w];
+	}
+	return (w<<5) + __builtin_ctz(free_bits);
+}
+
+// first set bit at or after k, nbits if there is none
+uint64_t bitmap_next_set(uint32_t *bitmap, uint64_t k) {
+	bitmap_index *index = bitmap_get_index(bitmap);
+	if(k >= index->nbits)	return index->nbits;
+	uint64_t w = k>>5;
+	uint32_t used_bits = bitmap[w] & (UINT32_MAX<<(k&31));
+	if(used_bits == 0) {
+		w = bitmap_summary_next(index, index->nonempty, w+1);
+		if(w == BITMAP_NOTFOUND)	return index->nbits;
+		used_bits = bitmap[w];
+	}
+	uint64_t k_set = (w<<5) + __builtin_ctz(used_bits);
+	return k_set < index->nbits ? k_set : index->nbits;
+}
+
+/* Lowest run of num clear bits starting at a multiple of align. Each step jumps from the
+ * start of a free run to its end and on to the next free run, so the cost grows with the
+ * number of free fragments too small for the request, not with the size of the bitmap. */
+uint64_t bitmap_find_run(uint32_t *bitmap, uint64_t num, uint64_t align) {
+	uint64_t start = 0, end;
+	for(;;) {
+		start = bitmap_next_clear(bitmap, start);
+		if(start == BITMAP_NOTFOUND)	return BITMAP_NOTFOUND;
+		VM_COUNT(alloc_scans, 1);
+		if(start % align) {
+			start += align - start%align;
+			continue;
+		}
+		end = bitmap_next_set(bitmap, start);
+		if(end-start >= num)	return start;
+		start = end;
+	}
+}
+
+void buddy_init() {
+	_buddy_next = (uint32_t*)malloc(_pagenum*sizeof(uint32_t));
+	_buddy_prev = (uint32_t*)malloc(_pagenum*sizeof(uint32_t));
+	_buddy_order = (int8_t*)malloc(_pagenum*sizeof(int8_t));
+	if(_buddy_next==NULL || _buddy_prev==NULL || _buddy_order==NULL) {
+		fprintf(stderr, "malloc for buddy allocator fails!\n");
+		exit(1);
+	}
+	memset(_buddy_order, -1, _pagenum*sizeof(int8_t));
+	for(int k=0;k<=BUDDY_MAXORDER;++k)	_buddy_head[k] = BUDDY_NIL;
+	_buddy_mask = 0;
+	_buddy_freeframes = 0;
+	_buddy_toporder = get_pow2(_pagenum);
+	if(_buddy_toporder > BUDDY_MAXORDER)	_buddy_toporder = BUDDY_MAXORDER;
+	buddy_free_range(0, _pagenum);
+	_buddy_release = true;
+}
+
+void buddy_push(pageno_t ppn, uint32_t order) {
+	_buddy_order[ppn] = order;
+	_buddy_prev[ppn] = BUDDY_NIL;
+	_buddy_next[ppn] = _buddy_head[order];
+	if(_buddy_head[order] != BUDDY_NIL)	_buddy_prev[_buddy_head[order]] = ppn;
+	_buddy_head[order] = ppn;
+	_buddy_mask |= 1U<<order;
+}
+
+void buddy_unlink(pageno_t ppn) {
+	uint32_t order = _buddy_order[ppn];
+	if(_buddy_prev[ppn] != BUDDY_NIL)	_buddy_next[_buddy_prev[ppn]] = _buddy_next[ppn];
+	else	_buddy_head[order] = _buddy_next[ppn];
+	if(_buddy_next[ppn] != BUDDY_NIL)	_buddy_prev[_buddy_next[ppn]] = _buddy_prev[ppn];
+	if(_buddy_head[order] == BUDDY_NIL)	_buddy_mask &= ~(1U<<order);
+	_buddy_order[ppn] = -1;
+}
+
+/* Take a free block of 2^order frames, splitting the smallest larger block if needed.
+ * Returns the first ppn of the block or BUDDY_NIL. */
+pageno_t buddy_alloc(uint32_t order) {
+	uint32_t avail = _buddy_mask & (UINT32_MAX<<order);
+	if(order>_buddy_toporder || avail==0)	return BUDDY_NIL;
+	uint32_t k = __builtin_ctz(avail);
+	pageno_t ppn = _buddy_head[k];
+	buddy_unlink(ppn);
+	// give the upper halves back until the block has the requested size
+	while(k > order) {
+		--k;
+		buddy_push(ppn+(1ULL<<k), k);
+	}
+	_buddy_freeframes -= 1ULL<<order;
+	for(uint64_t k=0;k<(1ULL<<order);++k)	set_bitmap(pbitmap, ppn+k);
+	return ppn;
+}
+
+// return a block of 2^order frames, merging it with its free buddies
+void buddy_free(pageno_t ppn, uint32_t order) {
+	_buddy_freeframes += 1ULL<<order;
+	for(uint64_t k=0;k<(1ULL<<order);++k)	clear_bitmap(pbitmap, ppn+k);
+	while(order < _buddy_toporder) {
+		pageno_t buddy = ppn ^ (1ULL<<order);
+		if(buddy>=_pagenum || _buddy_order[buddy]!=(int8_t)order)	break;
+		buddy_unlink(buddy);
+		if(buddy < ppn)	ppn = buddy;
+		++order;
+		// a block that just became this large is returned to the host, it reads as zeros when reused.
+		// The memfd behind memstart in native mode only gives its pages back to MADV_REMOVE
+		if(order==BUDDY_RELEASE_ORDER && _buddy_release)
+			madvise((void*)(transfer_ppntopfn(ppn)<<_offsetbits), PGSIZE<<order, _native ? MADV_REMOVE : MADV_DONTNEED);
+	}
+	buddy_push(ppn, order);
+}
+
+// free frames [ppn, ppn+num) as the largest aligned blocks that fit
+void buddy_free_range(pageno_t ppn, uint64_t num) {
+	pageno_t end = ppn+num;
+	while(ppn < end) {
+		uint32_t order = ppn==0 ? _buddy_toporder : __builtin_ctzll(ppn);
+		if(order > _buddy_toporder)	order = _buddy_toporder;
+		while(ppn+(1ULL<<order) > end)	--order;
+		buddy_free(ppn, order);
+		ppn += 1ULL<<order;
+	}
+}
+
+/* Allocate up to num physically contiguous frames: a block of the next power of two
+ * with the unused tail given back, or the largest smaller block when no such block is
+ * free. Returns the number of frames in the run starting at *ppn, 0 when memory is full. */
+uint64_t buddy_alloc_run(uint64_t num, pageno_t *ppn) {
+	uint32_t order = get_pow2(num);
+	if((1ULL<<order) < num)	++order;
+	if(order > _buddy_toporder)	order = _buddy_toporder;
+	if(_buddy_mask == 0)	return 0;
+	if(((_buddy_mask>>order)<<order) == 0)	order = 31-__builtin_clz(_buddy_mask);
+	*ppn = buddy_alloc(order);
+	uint64_t run = 1ULL<<order;
+	if(run > num) {
+		buddy_free_range(*ppn+num, run-num);
+		run = num;
+	}
+	return run;
+}
+
+// runs at thread exit: give the chunk back and hand the cached frames to the buddy allocator
+void frame_cache_release(void *arg) {
+	frame_cache *cache = (frame_cache*)arg;
+	pthread_mutex_lock(&_frame_caches_mutex);
+	frame_cache **link = &_frame_caches;
+	while(*link != cache)	link = &(*link)->next;
+	*link = cache->next;
+	pthread_mutex_unlock(&_frame_caches_mutex);
+	if(cache->chunk != BITMAP_NOTFOUND) {
+		// the chunk is in the default context, whichever one the thread ended in
+		_vm_current = NULL;
+		hold_wlock(&_pagetable_lock);
+		chunk_release(cache);
+		release_lock(&_pagetable_lock);
+	}
+	frame_cache_drain(cache, cache->count);
+	pthread_mutex_destroy(&cache->lock);
+	_frame_local = NULL;
+	free(cache);
+}
+
+void frame_key_create() {
+	if(0 != pthread_key_create(&_frame_key, frame_cache_release)) {
+		fprintf(stderr, "pthread_key_create(&_frame_key) fails!\n");
+		exit(1);
+	}
+}
+
+frame_cache *frame_cache_current() {
+	frame_cache *cache = _frame_local;
+	if(cache == NULL) {
+		pthread_once(&_frame_key_once, frame_key_create);
+		cache = (frame_cache*)calloc(1, sizeof(frame_cache));
+		if(cache == NULL) {
+			fprintf(stderr, "calloc for frame_cache fails!\n");
+			exit(1);
+		}
+		pthread_mutex_init(&cache->lock, NULL);
+		cache->chunk = BITMAP_NOTFOUND;
+		pthread_setspecific(_frame_key, cache);
+		_frame_local = cache;
+		pthread_mutex_lock(&_frame_caches_mutex);
+		cache->next = _frame_caches;
+		_frame_caches = cache;
+		pthread_mutex_unlock(&_frame_caches_mutex);
+	}
+	return cache;
+}
+
+// give the num most recently cached frames back to the buddy allocator
+void frame_cache_drain(frame_cache *cache, uint32_t num) {
+	pthread_mutex_lock(&_frame_lock);
+	for(uint32_t k=0;k<num;++k)	buddy_free(cache->frame[--cache->count], 0);
+	pthread_mutex_unlock(&_frame_lock);
+}
+
+/* Take num frames from the calling thread's cache, refilling it with a contiguous batch
+ * from the buddy allocator when it runs short. When that has too few, the frames cached by
+ * other threads are reclaimed first. Returns false when memory is full. */
+bool frame_cache_get(uint64_t num, pageno_t *frames) {
+	frame_cache *cache = frame_cache_current();
+	pthread_mutex_lock(&cache->lock);
+	for(int tries=0;tries<2 && cache->count<num;++tries) {
+		if(tries > 0) {
+			pthread_mutex_unlock(&cache->lock);
+			frame_cache_reclaim();
+			pthread_mutex_lock(&cache->lock);
+		}
+		pthread_mutex_lock(&_frame_lock);
+		while(cache->count < FRAME_CACHE_BATCH) {
+			pageno_t ppn;
+			uint64_t run = buddy_alloc_run(FRAME_CACHE_BATCH-cache->count, &ppn);
+			if(run == 0)	break;
+			// pushed backwards so the frames are popped in ascending order
+			for(uint64_t k=run;k>0;--k)	cache->frame[cache->count++] = ppn+k-1;
+		}
+		pthread_mutex_unlock(&_frame_lock);
+	}
+	bool got = cache->count >= num;
+	if(got)
+		for(uint64_t k=0;k<num;++k)	frames[k] = cache->frame[--cache->count];
+	pthread_mutex_unlock(&cache->lock);
+	return got;
+}
+
+// hand the frames of every thread's cache back to the buddy allocator, when memory runs short
+void frame_cache_reclaim() {
+	pthread_mutex_lock(&_frame_caches_mutex);
+	for(frame_cache *cache=_frame_caches;cache!=NULL;cache=cache->next) {
+		pthread_mutex_lock(&cache->lock);
+		frame_cache_drain(cache, cache->count);
+		pthread_mutex_unlock(&cache->lock);
+	}
+	pthread_mutex_unlock(&_frame_caches_mutex);
+}
+
+// return a frame that is no longer mapped through the calling thread's cache
+void frame_free(pageno_t ppn) {
+	frame_cache *cache = frame_cache_current();
+	pthread_mutex_lock(&cache->lock);
+	if(cache->count == FRAME_CACHE_SIZE)	frame_cache_drain(cache, FRAME_CACHE_BATCH);
+	cache->frame[cache->count++] = ppn;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+uint32_t get_pageoffset(address_t va) {
+	return va & ~((~0)<<_offsetbits);
+}
+
+uint32_t get_pgdindex(address_t va) {
+	return va >> (_offsetbits + 3*LEVELBITS);
+}
+
+uint32_t get_pudindex(address_t va) {
+	return (va >> (_offsetbits + 2*LEVELBITS)) & ~((~0)<<LEVELBITS);
+}
+
+uint32_t get_pmdindex(address_t va) {
+	return (va >> (_offsetbits + LEVELBITS)) & ~((~0)<<LEVELBITS);
+}
+
+uint32_t get_pteindex(address_t va) {
+	return (va>>_offsetbits) & ~((~0)<<LEVELBITS);
+}
+
+uint32_t get_pow2(uint64_t number) {
+	uint32_t counter = 0;
+	number >>= 1;
+	while(number) {
+		++counter;
+		number >>= 1;
+	}
+	return counter;
+}
+
+pageno_t transfer_ppntopfn(pageno_t ppn) {
+	return (((address_t)memstart)>>_offsetbits) + ppn;
+}
+
+pageno_t transfer_pfntoppn(pageno_t pfn) {
+	return pfn - ((address_t)memstart>>_offsetbits);
+}
+
+/* ALLOC_EAGER binds a frame to every page at allocation time. ALLOC_LAZY only reserves the
+ * virtual pages, which get a frame on their first write, so allocations may add up to more
+ * than MAX_MEMSIZE as long as the pages actually written fit. Applies to later allocations. */
+void set_alloc_mode(alloc_mode mode) {
+	_allocmode = mode;
+}
+
+/* Map eager allocations of at least HUGE_PAGES pages with 2 MiB pmd entries (the default)
+ * or always with 4K pages. Applies to later allocations. */
+void set_huge_mappings(bool enable) {
+	_hugemap = enable;
+}
+
+/* Ask for transparent huge pages behind the simulated physical memory. Only has an effect
+ * before the first allocation. */
+void set_mem_hugepages(bool enable) {
+	_mem_thp = enable;
+}
+
+/* Number of p_mat_mult worker threads, 0 for one per online CPU. A running pool is stopped
+ * and restarted with the new size by the next p_mat_mult, so do not call this while a
+ * p_mat_mult is in progress. */
+void set_pool_size(uint32_t nthreads) {
+	pool_shutdown();
+	pthread_mutex_lock(&_pool_lock);
+	_pool_size = nthreads;
+	pthread_mutex_unlock(&_pool_lock);
+}
+
+uint32_t get_pool_size() {
+	pthread_mutex_lock(&_pool_lock);
+	uint32_t size = _pool_running!=0 ? _pool_running : _pool_size;
+	pthread_mutex_unlock(&_pool_lock);
+	return size;
+}
+
+// stop and join the workers, the next p_mat_mult starts them again
+void pool_shutdown() {
+	pthread_mutex_lock(&_pool_lock);
+	uint32_t running = _pool_running;
+	_pool_stop = true;
+	pthread_cond_broadcast(&_pool_cond);
+	pthread_mutex_unlock(&_pool_lock);
+	for(uint32_t w=0;w<running;++w)	pthread_join(_pool_threads[w], NULL);
+	pthread_mutex_lock(&_pool_lock);
+	for(uint32_t w=0;w<running;++w) {
+		free(_pool_deque[w].task);
+		pthread_mutex_destroy(&_pool_deque[w].lock);
+	}
+	__atomic_store_n(&_pool_running, 0, __ATOMIC_RELEASE);
+	_pool_stop = false;
+	pthread_mutex_unlock(&_pool_lock);
+}
+
+void pool_start() {
+	pthread_mutex_lock(&_pool_lock);
+	if(_pool_running == 0) {
+		uint32_t size = _pool_size;
+		if(size == 0) {
+			long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+			size = cpus>0 ? cpus : 1;
+		}
+		if(size > POOL_MAXTHREADS)	size = POOL_MAXTHREADS;
+		for(uint32_t w=0;w<size;++w) {
+			memset(&_pool_deque[w], 0, sizeof(pool_deque));
+			pthread_mutex_init(&_pool_deque[w].lock, NULL);
+		}
+		for(uint32_t w=0;w<size;++w)
+			if(0 != pthread_create(&_pool_threads[w], NULL, pool_worker, (void*)(uintptr_t)w)) {
+				fprintf(stderr, "pthread_create for pool worker %"PRIu32" fails!\n", w);
+				exit(1);
+			}
+		__atomic_store_n(&_pool_running, size, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&_pool_lock);
+}
+
+// queue a task on worker w, called with _pool_lock held
+void pool_push(uint32_t w, pool_task task) {
+	pool_deque *deque = &_pool_deque[w];
+	pthread_mutex_lock(&deque->lock);
+	if(deque->tail == deque->cap) {
+		// move the live tasks to the front before growing
+		uint32_t live = deque->tail-deque->head;
+		memmove(deque->task, deque->task+deque->head, live*sizeof(pool_task));
+		deque->head = 0;
+		deque->tail = live;
+		if(live == deque->cap) {
+			deque->cap = deque->cap==0 ? 64 : 2*deque->cap;
+			deque->task = (pool_task*)realloc(deque->task, deque->cap*sizeof(pool_task));
+			if(deque->task == NULL) {
+				fprintf(stderr, "realloc for pool deque fails!\n");
+				exit(1);
+			}
+		}
+	}
+	deque->task[deque->tail++] = task;
+	pthread_mutex_unlock(&deque->lock);
+}
+
+/* Take a task: the newest one of worker self, else the oldest one of another worker. self is
+ * -1 for a thread outside the pool, which only steals. Returns false when every deque is empty. */
+bool pool_take(int self, pool_task *task) {
+	// read without _pool_lock, pool_start() publishes the deques before the count
+	uint32_t workers = __atomic_load_n(&_pool_running, __ATOMIC_ACQUIRE);
+	for(uint32_t i=0;i<workers;++i) {
+		uint32_t w = self<0 ? i : (self+i)%workers;
+		pool_deque *deque = &_pool_deque[w];
+		pthread_mutex_lock(&deque->lock);
+		if(deque->head == deque->tail) {
+			pthread_mutex_unlock(&deque->lock);
+			continue;
+		}
+		if(i==0 && self>=0)	*task = deque->task[--deque->tail];
+		else	*task = deque->task[deque->head++];
+		pthread_mutex_unlock(&deque->lock);
+		__atomic_sub_fetch(&_pool_pending, 1, __ATOMIC_RELAXED);
+		return true;
+	}
+	return false;
+}
+
+/* Compute one tile and wake the caller of p_mat_mult after the last one. The count drops
+ * under job->lock, so the caller cannot see it reach 0 and destroy the job on its stack while
+ * the last worker still signals. */
+void pool_run(pool_task task) {
+	mat_job *job = task.job;
+	// the tile is computed in the address space of the caller of p_mat_mult
+	vm_context *prev = vm_switch(job->ctx);
+	mat_mult_tile(job->mat1, job->mat2, job->size, job->answer, task.tile/job->tilecols*MAT_TILE,
+			task.tile%job->tilecols*MAT_TILE, job->kernel, true);
+	vm_switch(prev);
+	pthread_mutex_lock(&job->lock);
+	if(__atomic_sub_fetch(&job->remaining, 1, __ATOMIC_ACQ_REL) == 0)	pthread_cond_signal(&job->done);
+	pthread_mutex_unlock(&job->lock);
+}
+
+void *pool_worker(void *arg) {
+	int self = (int)(uintptr_t)arg;
+	pool_task task;
+	for(;;) {
+		while(pool_take(self, &task))	pool_run(task);
+		pthread_mutex_lock(&_pool_lock);
+		while(__atomic_load_n(&_pool_pending, __ATOMIC_RELAXED)==0 && !_pool_stop)	pthread_cond_wait(&_pool_cond, &_pool_lock);
+		bool stop = _pool_stop;
+		pthread_mutex_unlock(&_pool_lock);
+		if(stop)	return NULL;
+	}
+}
+
+/* Choose the TLB organization: ways entries per set (a power of two dividing TLBSIZE,
+ * TLBSIZE gives a fully associative TLB) and the replacement policy. Call it before the
+ * first allocation, or while no other thread is using the TLB since it flushes all entries. */
+void set_tlb_config(uint32_t ways, tlb_policy policy) {
+	if(ways==0 || ways>TLBSIZE || (ways&(ways-1))!=0) {
+		fprintf(stderr, "set_tlb_config: ways=%"PRIu32" must be a power of two no larger than %d\n", ways, TLBSIZE);
+		return;
+	}
+	_tlbconf_ways = ways;
+	_tlbconf_policy = policy;
+	if(_init_physical)	tlb_init();
+}
+
+/* Choose between the shared TLB and private per thread TLBs, with the same restrictions as set_tlb_config() */
+void set_tlb_mode(tlb_mode mode) {
+	_tlbconf_mode = mode;
+	if(_init_physical)	tlb_init();
+}
+
+void tlb_cache_flush(tlb_cache *cache) {
+	for(int i=0;i<TLBSIZE;++i) {
+		cache->entry[i].valid = false;
+		cache->entry[i].ref = false;
+		cache->entry[i].stamp = 0;
+		cache->tick[i] = 0;
+		cache->hand[i] = 0;
+	}
+	for(int i=0;i<TLBHUGESIZE;++i) {
+		cache->huge[i].valid = false;
+		cache->huge[i].ref = false;
+		cache->huge[i].stamp = 0;
+	}
+	cache->hugetick = 0;
+	cache->hugehand = 0;
+}
+
+void tlb_init() {
+	_tlbways = _tlbconf_ways;
+	_tlbsets = TLBSIZE/_tlbways;
+	_tlbpolicy = _tlbconf_policy;
+	_tlbmode = _tlbconf_mode;
+	_tlbmodbits = _tlbsets-1;
+	tlb_cache_flush(&_tlb_shared);
+	_tlb_shared.hits = 0;
+	_tlb_shared.misses = 0;
+
+	// the set layout may have changed, so every private TLB has to start over
+	pthread_mutex_lock(&_tlb_threads_mutex);
+	for(tlb_cache *cache=_tlb_threads;cache!=NULL;cache=cache->next) {
+		__atomic_store_n(&cache->hits, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&cache->misses, 0, __ATOMIC_RELAXED);
+	}
+	_tlb_retired_hits = 0;
+	_tlb_retired_misses = 0;
+	pthread_mutex_unlock(&_tlb_threads_mutex);
+	__atomic_add_fetch(&_tlb_epoch, TLB_SHOOTDOWN_LOG+1, __ATOMIC_RELEASE);
+}
+
+// runs at thread exit: keep the counts of the private TLB and unlink it
+void tlb_cache_release(void *arg) {
+	tlb_cache *cache = (tlb_cache*)arg;
+	pthread_mutex_lock(&_tlb_threads_mutex);
+	for(tlb_cache **pp=&_tlb_threads;*pp!=NULL;pp=&(*pp)->next)
+		if(*pp == cache) {
+			*pp = cache->next;
+			break;
+		}
+	_tlb_retired_hits += cache->hits;
+	_tlb_retired_misses += cache->misses;
+	pthread_mutex_unlock(&_tlb_threads_mutex);
+	free(cache);
+}
+
+void tlb_key_create() {
+	if(0 != pthread_key_create(&_tlb_key, tlb_cache_release)) {
+		fprintf(stderr, "pthread_key_create(&_tlb_key) fails!\n");
+		exit(1);
+	}
+}
+
+/* The TLB used by the calling thread. In TLB_THREAD mode the private TLB first replays
+ * the shootdowns it has missed, or flushes everything when it is too far behind. */
+tlb_cache *tlb_current() {
+	if(_tlbmode == TLB_SHARED)	return &_tlb_shared;
+
+	tlb_cache *cache = _tlb_local;
+	if(cache == NULL) {
+		pthread_once(&_tlb_key_once, tlb_key_create);
+		cache = (tlb_cache*)calloc(1, sizeof(tlb_cache));
+		if(cache == NULL) {
+			fprintf(stderr, "calloc for tlb_cache fails!\n");
+			exit(1);
+		}
+		cache->epoch = __atomic_load_n(&_tlb_epoch, __ATOMIC_ACQUIRE);
+		pthread_setspecific(_tlb_key, cache);
+		pthread_mutex_lock(&_tlb_threads_mutex);
+		cache->next = _tlb_threads;
+		_tlb_threads = cache;
+		pthread_mutex_unlock(&_tlb_threads_mutex);
+		_tlb_local = cache;
+	}
+
+	uint64_t epoch = __atomic_load_n(&_tlb_epoch, __ATOMIC_ACQUIRE);
+	if(epoch != cache->epoch) {
+		// only half of the log is replayed, the other half may be rewritten by a batch of tlb_freerange()
+		if(epoch-cache->epoch > TLB_SHOOTDOWN_LOG/2)	tlb_cache_flush(cache);
+		else {
+			for(uint64_t e=cache->epoch;e<epoch;++e) {
+				pageno_t vpn = __atomic_load_n(&_tlb_shootlog[e%TLB_SHOOTDOWN_LOG], __ATOMIC_RELAXED);
+				tlb_invalidate(cache, vpn&~TLB_SHOOT_HUGE, (vpn&TLB_SHOOT_HUGE)!=0);
+			}
+			// the log may have wrapped while it was replayed
+			if(__atomic_load_n(&_tlb_epoch, __ATOMIC_ACQUIRE)-cache->epoch > TLB_SHOOTDOWN_LOG/2)	tlb_cache_flush(cache);
+		}
+		cache->epoch = epoch;
+	}
+	return cache;
+}
+
+/* The TLB functions take the vpn tagged by vm_tag(). The asid picks the set together with
+ * the vpn, so the same addresses of different contexts do not all compete for one set. */
+uint32_t tlb_set(pageno_t vpn) {
+	return (vpn ^ vpn>>VM_ASID_SHIFT) & _tlbmodbits;
+}
+
+// the shared TLB is updated by concurrent readers, a private one only by its owner
+void tlb_count(uint64_t *counter) {
+	if(_tlbmode == TLB_SHARED)	__atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+	else	__atomic_store_n(counter, *counter+1, __ATOMIC_RELAXED);
+}
+
+// several readers may hit the same shared entry concurrently, so the policy state is updated atomically
+void tlb_touch(tlb *entry, uint64_t *tick) {
+	if(_tlbpolicy == TLB_LRU) {
+		uint64_t stamp = _tlbmode==TLB_SHARED ? __atomic_add_fetch(tick, 1, __ATOMIC_RELAXED) : ++*tick;
+		__atomic_store_n(&entry->stamp, stamp, __ATOMIC_RELAXED);
+	}else if(_tlbpolicy == TLB_CLOCK)
+		__atomic_store_n(&entry->ref, true, __ATOMIC_RELAXED);
+}
+
+// the pfn cached for the 4K page vpn, 0 on a miss
+uint64_t tlb_lookup(pageno_t vpn) {
+	tlb_cache *cache = tlb_current();
+	uint32_t set = tlb_set(vpn);
+	tlb *entry = &cache->entry[set*_tlbways];
+	for(uint32_t i=0;i<_tlbways;++i)
+		if(entry[i].valid==true && entry[i].key==vpn) {
+			tlb_touch(&entry[i], &cache->tick[set]);
+			return entry[i].value;
+		}
+	return 0;
+}
+
+// the pfn of vpn from a cached 2 MiB mapping, 0 on a miss
+uint64_t tlb_lookup_huge(pageno_t vpn) {
+	tlb_cache *cache = tlb_current();
+	pageno_t key = vpn>>HUGE_ORDER;
+	for(uint32_t i=0;i<TLBHUGESIZE;++i)
+		if(cache->huge[i].valid==true && cache->huge[i].key==key) {
+			tlb_touch(&cache->huge[i], &cache->hugetick);
+			return cache->huge[i].value + (vpn&(HUGE_PAGES-1));
+		}
+	return 0;
+}
+
+// put key/value into a set of ways entries, evicting by the replacement policy when it is full
+void tlb_insert(tlb_cache *cache, tlb *entry, uint32_t ways, uint64_t *tick, uint32_t *hand, pageno_t key, pageno_t value) {
+	uint32_t victim = ways;
+	for(uint32_t i=0;i<ways;++i) {
+		if(entry[i].valid==true && entry[i].key==key) {	// refilled by a concurrent miss
+			victim = i;
+			break;
+		}
+		if(entry[i].valid==false && victim==ways)	victim = i;
+	}
+
+	if(victim == ways) {
+		switch(_tlbpolicy) {
+		case TLB_LRU:
+			victim = 0;
+			for(uint32_t i=1;i<ways;++i)
+				if(entry[i].stamp < entry[victim].stamp)	victim = i;
+			break;
+		case TLB_CLOCK:
+			// second chance: clear reference bits until an unreferenced entry comes under the hand
+			while(entry[*hand].ref) {
+				entry[*hand].ref = false;
+				*hand = (*hand+1) & (ways-1);
+			}
+			victim = *hand;
+			*hand = (*hand+1) & (ways-1);
+			break;
+		case TLB_RANDOM:
+			if(cache->seed == 0)	cache->seed = (uint32_t)(address_t)cache | 1;
+			cache->seed ^= cache->seed<<13;
+			cache->seed ^= cache->seed>>17;
+			cache->seed ^= cache->seed<<5;
+			victim = cache->seed & (ways-1);
+			break;
+		}
+	}
+	entry[victim].key = key;
+	entry[victim].value = value;
+	entry[victim].ref = true;
+	entry[victim].stamp = _tlbmode==TLB_SHARED ? __atomic_add_fetch(tick, 1, __ATOMIC_RELAXED) : ++*tick;
+	entry[victim].valid = true;
+}
+
+// cache the translation of vpn, for a huge mapping the whole 2 MiB block it belongs to
+void tlb_add(pageno_t vpn, pageno_t pfn, bool huge) {
+	tlb_cache *cache = tlb_current();
+	if(huge) {
+		tlb_insert(cache, cache->huge, TLBHUGESIZE, &cache->hugetick, &cache->hugehand, vpn>>HUGE_ORDER, pfn-(vpn&(HUGE_PAGES-1)));
+		return;
+	}
+	uint32_t set = tlb_set(vpn);
+	tlb_insert(cache, &cache->entry[set*_tlbways], _tlbways, &cache->tick[set], &cache->hand[set], vpn, pfn);
+}
+
+/* Insert a translation found by a walk that started at shootdown epoch. If a shootdown
+ * happened since, the walk may have read an entry that ufree cleared, so it is not cached. */
+void tlb_fill(pageno_t vpn, pageno_t pfn, uint64_t epoch, bool huge) {
+	if(_tlbmode == TLB_THREAD) {
+		if(__atomic_load_n(&_tlb_epoch, __ATOMIC_ACQUIRE) == epoch)	tlb_add(vpn, pfn, huge);
+		return;
+	}
+	pthread_rwlock_t *lock = huge ? &_tlb_hugelock : &_tlb_lock[tlb_set(vpn)];
+	hold_wlock(lock);
+	if(__atomic_load_n(&_tlb_epoch, __ATOMIC_ACQUIRE) == epoch)	tlb_add(vpn, pfn, huge);
+	release_lock(lock);
+}
+
+// drop the entry for vpn, or for the 2 MiB block of vpn when huge
+void tlb_invalidate(tlb_cache *cache, pageno_t vpn, bool huge) {
+	if(huge) {
+		for(uint32_t i=0;i<TLBHUGESIZE;++i)
+			if(cache->huge[i].key==vpn>>HUGE_ORDER)	cache->huge[i].valid = false;
+		return;
+	}
+	tlb *entry = &cache->entry[tlb_set(vpn)*_tlbways];
+	for(uint32_t i=0;i<_tlbways;++i)
+		if(entry[i].key==vpn)	entry[i].valid = false;
+}
+
+/* Invalidate vpn (its 2 MiB block when huge) and advance the shootdown epoch. Private TLBs
+ * cannot be touched from here, so the vpn is published in the shootdown log and each thread
+ * drops it the next time it uses its TLB. Threads freeing pages of their chunk do not hold
+ * _pagetable_lock, _tlb_shoot_lock keeps a single writer of the log. */
+void tlb_freeupdate(pageno_t vpn, bool huge) {
+	VM_COUNT(shootdowns, 1);
+	pthread_mutex_lock(&_tlb_shoot_lock);
+	uint64_t epoch = __atomic_load_n(&_tlb_epoch, __ATOMIC_RELAXED);
+	if(_tlbmode == TLB_THREAD) {
+		__atomic_store_n(&_tlb_shootlog[epoch%TLB_SHOOTDOWN_LOG], huge ? vpn|TLB_SHOOT_HUGE : vpn, __ATOMIC_RELAXED);
+		__atomic_store_n(&_tlb_epoch, epoch+1, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&_tlb_shoot_lock);
+		return;
+	}
+	// fills of walks that started before this point are refused from now on, the entry
+	// already cleared in the page table cannot come back after the invalidation
+	__atomic_store_n(&_tlb_epoch, epoch+1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&_tlb_shoot_lock);
+	pthread_rwlock_t *lock = huge ? &_tlb_hugelock : &_tlb_lock[tlb_set(vpn)];
+	hold_wlock(lock);
+	tlb_invalidate(&_tlb_shared, vpn, huge);
+	release_lock(lock);
+}
+
+/* Invalidate the 4K translations of [vpn, vpn+num) with a single shootdown epoch advance, the
+ * huge ones too when the range is large. A range too long for the log makes every private
+ * TLB flush completely. Like tlb_freeupdate(), called after the entries have been cleared. */
+void tlb_freerange(pageno_t vpn, uint64_t num) {
+	VM_COUNT(shootdowns, 1);
+	pthread_mutex_lock(&_tlb_shoot_lock);
+	uint64_t epoch = __atomic_load_n(&_tlb_epoch, __ATOMIC_RELAXED);
+	if(_tlbmode == TLB_THREAD) {
+		if(num <= TLB_SHOOTDOWN_LOG/2) {
+			for(uint64_t k=0;k<num;++k)
+				__atomic_store_n(&_tlb_shootlog[(epoch+k)%TLB_SHOOTDOWN_LOG], vpn+k, __ATOMIC_RELAXED);
+			__atomic_store_n(&_tlb_epoch, epoch+num, __ATOMIC_RELEASE);
+		}else	__atomic_store_n(&_tlb_epoch, epoch+TLB_SHOOTDOWN_LOG+1, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&_tlb_shoot_lock);
+		return;
+	}
+	__atomic_store_n(&_tlb_epoch, epoch+1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&_tlb_shoot_lock);
+	if(num < TLBSIZE) {
+		for(uint64_t k=0;k<num;++k) {
+			uint32_t set = tlb_set(vpn+k);
+			hold_wlock(&_tlb_lock[set]);
+			tlb_invalidate(&_tlb_shared, vpn+k, false);
+			release_lock(&_tlb_lock[set]);
+		}
+		return;
+	}
+	for(uint32_t set=0;set<_tlbsets;++set) {
+		hold_wlock(&_tlb_lock[set]);
+		tlb *entry = &_tlb_shared.entry[set*_tlbways];
+		for(uint32_t i=0;i<_tlbways;++i)
+			if(entry[i].key>=vpn && entry[i].key<vpn+num)	entry[i].valid = false;
+		release_lock(&_tlb_lock[set]);
+	}
+	hold_wlock(&_tlb_hugelock);
+	for(uint32_t i=0;i<TLBHUGESIZE;++i)
+		if((_tlb_shared.huge[i].key+1)<<HUGE_ORDER>vpn && _tlb_shared.huge[i].key<<HUGE_ORDER<vpn+num)
+			_tlb_shared.huge[i].valid = false;
+	release_lock(&_tlb_hugelock);
+}
+
+void tlb_stats(uint64_t *hits, uint64_t *misses) {
+	uint64_t h = __atomic_load_n(&_tlb_shared.hits, __ATOMIC_RELAXED);
+	uint64_t m = __atomic_load_n(&_tlb_shared.misses, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&_tlb_threads_mutex);
+	h += _tlb_retired_hits;
+	m += _tlb_retired_misses;
+	for(tlb_cache *cache=_tlb_threads;cache!=NULL;cache=cache->next) {
+		h += __atomic_load_n(&cache->hits, __ATOMIC_RELAXED);
+		m += __atomic_load_n(&cache->misses, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&_tlb_threads_mutex);
+	if(hits != NULL)	*hits = h;
+	if(misses != NULL)	*misses = m;
+}
+
+void print_TLB_missrate() {
+	static const char *policy_name[] = {"LRU", "CLOCK", "RANDOM"};
+	static const char *mode_name[] = {"shared", "per-thread"};
+	uint64_t hits, misses;
+	tlb_stats(&hits, &misses);
+	double miss_rate = hits+misses==0 ? 0 : (double)misses/(hits+misses);
+	fprintf(stderr, "TLB %s %"PRIu32"x%"PRIu32"-way %s: hits=%"PRIu64" misses=%"PRIu64" miss rate=%lf\n",
+			mode_name[_tlbmode], _tlbsets, _tlbways, policy_name[_tlbpolicy], hits, misses, miss_rate);
+}
+
+// index of the smallest size class holding num_bytes
+uint32_t slab_class(uint64_t num_bytes) {
+	uint32_t class = 0;
+	while((SLAB_MINSIZE<<class) < num_bytes)	++class;
+	return class;
+}
+
+// the slab occupying page vpn, NULL for pages allocated whole
+slab *slab_lookup(pageno_t vpn) {
+	slab ***dir = vm_current()->slab_dir;
+	if(dir==NULL || vpn>=_vpagenum)	return NULL;
+	slab **chunk = __atomic_load_n(&dir[vpn>>LEVELBITS], __ATOMIC_ACQUIRE);
+	if(chunk == NULL)	return NULL;
+	return __atomic_load_n(&chunk[vpn&(_tablesize-1)], __ATOMIC_ACQUIRE);
+}
+
+void slab_setdir(pageno_t vpn, slab *s) {
+	slab ***dir = vm_current()->slab_dir;
+	slab **chunk = __atomic_load_n(&dir[vpn>>LEVELBITS], __ATOMIC_ACQUIRE);
+	if(chunk == NULL) {
+		// slabs of other classes may be created concurrently, the first chunk published wins
+		slab **fresh = (slab**)calloc(_tablesize, sizeof(slab*));
+		if(fresh == NULL) {
+			fprintf(stderr, "calloc for slab directory fails!\n");
+			exit(1);
+		}
+		if(__atomic_compare_exchange_n(&dir[vpn>>LEVELBITS], &chunk, fresh, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			chunk = fresh;
+		else	free(fresh);
+	}
+	__atomic_store_n(&chunk[vpn&(_tablesize-1)], s, __ATOMIC_RELEASE);
+}
+
+void slab_unlink(uint32_t class, slab *s) {
+	if(s->prev != NULL)	s->prev->next = s->next;
+	else	vm_current()->slab_partial[class] = s->next;
+	if(s->next != NULL)	s->next->prev = s->prev;
+	s->next = s->prev = NULL;
+}
+
+/* Hand out an object of the size class of num_bytes, starting a new slab page when the
+ * class has no free object. Objects are given lowest address first. */
+void *slab_alloc(uint64_t num_bytes, bool threadsafe) {
+	uint32_t class = slab_class(num_bytes);
+	vm_context *ctx = vm_current();
+	pthread_mutex_lock(&ctx->slab_lock[class]);
+	slab *s = ctx->slab_partial[class];
+	if(s == NULL) {
+		pageno_t vpn = page_alloc(1, threadsafe);
+		if(vpn == BITMAP_NOTFOUND) {
+			pthread_mutex_unlock(&ctx->slab_lock[class]);
+			return NULL;
+		}
+		s = (slab*)calloc(1, sizeof(slab));
+		if(s == NULL) {
+			fprintf(stderr, "calloc for slab fails!\n");
+			exit(1);
+		}
+		s->vpn = vpn;
+		s->size = SLAB_MINSIZE<<class;
+		s->total = s->nfree = PGSIZE/s->size;
+		for(uint32_t k=0;k<s->total;++k)	s->freemap[k>>6] |= 1ULL<<(k&63);
+		slab_setdir(vpn, s);
+		ctx->slab_partial[class] = s;
+	}
+	uint32_t w = 0;
+	while(s->freemap[w] == 0)	++w;
+	uint32_t k = (w<<6) + __builtin_ctzll(s->freemap[w]);
+	s->freemap[w] &= ~(1ULL<<(k&63));
+	if(--s->nfree == 0)	slab_unlink(class, s);
+	pthread_mutex_unlock(&ctx->slab_lock[class]);
+	return (void*)((s->vpn<<_offsetbits) + (address_t)k*s->size);
+}
+
+/* Return va to its slab if it lies in a slab page, false otherwise. A slab whose objects
+ * are all free gives its page back, unless it is the only partial slab of its class. */
+bool slab_free(void *va, bool threadsafe) {
+	pageno_t vpn = (address_t)va>>_offsetbits;
+	// an object of the slab is still allocated, so the slab cannot go away under us
+	slab *s = slab_lookup(vpn);
+	if(s == NULL)	return false;
+	uint32_t class = slab_class(s->size);
+	uint32_t offset = get_pageoffset((address_t)va);
+	uint32_t k = offset/s->size;
+	vm_context *ctx = vm_current();
+	pthread_mutex_lock(&ctx->slab_lock[class]);
+	if(offset%s->size!=0 || (s->freemap[k>>6]>>(k&63))&1) {
+		pthread_mutex_unlock(&ctx->slab_lock[class]);
+		return true;	// not an object start, or freed twice
+	}
+	s->freemap[k>>6] |= 1ULL<<(k&63);
+	if(s->nfree++ == 0) {
+		s->next = ctx->slab_partial[class];
+		s->prev = NULL;
+		if(s->next != NULL)	s->next->prev = s;
+		ctx->slab_partial[class] = s;
+	}
+	if(s->nfree==s->total && (s->prev!=NULL || s->next!=NULL)) {
+		slab_unlink(class, s);
+		slab_setdir(vpn, NULL);
+		if(!threadsafe)	unmap_pages(vpn, 1);
+		else if(!chunk_unmap(vpn, 1)) {
+			hold_wlock(&_pagetable_lock);
+			unmap_pages(vpn, 1);
+			release_lock(&_pagetable_lock);
+		}
+		free(s);
+	}
+	pthread_mutex_unlock(&ctx->slab_lock[class]);
+	return true;
+}
+
+// the counter shard of the calling thread, a free shard of an exited thread is reused
+stats_shard *stats_local() {
+	stats_shard *shard = _stats_local;
+	if(shard != NULL)	return shard;
+	pthread_once(&_stats_key_once, stats_key_create);
+	pthread_mutex_lock(&_stats_mutex);
+	for(shard=_stats_shards;shard!=NULL && shard->active;shard=shard->next);
+	if(shard == NULL) {
+		shard = (stats_shard*)calloc(1, sizeof(stats_shard));
+		if(shard == NULL) {
+			fprintf(stderr, "calloc for stats_shard fails!\n");
+			exit(1);
+		}
+		shard->next = _stats_shards;
+		__atomic_store_n(&_stats_shards, shard, __ATOMIC_RELEASE);
+	}
+	shard->active = true;
+	pthread_mutex_unlock(&_stats_mutex);
+	pthread_setspecific(_stats_key, shard);
+	_stats_local = shard;
+	return shard;
+}
+
+// runs at thread exit, the counts stay in the shard
+void stats_release(void *arg) {
+	pthread_mutex_lock(&_stats_mutex);
+	((stats_shard*)arg)->active = false;
+	pthread_mutex_unlock(&_stats_mutex);
+}
+
+void stats_key_create() {
+	if(0 != pthread_key_create(&_stats_key, stats_release)) {
+		fprintf(stderr, "pthread_key_create(&_stats_key) fails!\n");
+		exit(1);
+	}
+}
+
+/* Sum of the counters of all threads so far. Shards are read while their threads keep
+ * counting, so the sum is a snapshot that may miss the latest events. */
+void vm_stats(vm_counters *stats) {
+	memset(stats, 0, sizeof(vm_counters));
+	uint64_t *sum = (uint64_t*)stats;
+	for(stats_shard *shard=__atomic_load_n(&_stats_shards, __ATOMIC_ACQUIRE);shard!=NULL;shard=shard->next) {
+		uint64_t *count = (uint64_t*)&shard->count;
+		for(size_t i=0;i<sizeof(vm_counters)/sizeof(uint64_t);++i)	sum[i] += __atomic_load_n(&count[i], __ATOMIC_RELAXED);
+	}
+	tlb_stats(&stats->tlb_hits, &stats->tlb_misses);
+	stats->table_bytes = __atomic_load_n(&_table_used, __ATOMIC_RELAXED)*PGSIZE;
+	swap_stats(&stats->swap_ins, &stats->swap_outs);
+}
+
+// vm_stats() as one line of JSON
+void vm_stats_dump(FILE *out) {
+	// in the order of the vm_counters fields
+	static const char *name[] = {"translations", "tlb_hits", "tlb_misses", "page_walks", "shootdowns",
+		"allocs", "alloc_scans", "page_maps", "frees", "pages_freed", "page_faults", "native_faults",
+		"pt_lock_waits", "pt_lock_wait_ns", "tlb_lock_waits", "tlb_lock_wait_ns", "table_bytes", "swap_ins", "swap_outs"};
+	vm_counters stats;
+	vm_stats(&stats);
+	uint64_t *count = (uint64_t*)&stats;
+	fprintf(out, "{");
+	for(size_t i=0;i<sizeof(vm_counters)/sizeof(uint64_t);++i)
+		fprintf(out, "%s\"%s\": %"PRIu64, i==0 ? "" : ", ", name[i], count[i]);
+	fprintf(out, "}\n");
+	fflush(out);
+}
+
+/* Dump vm_stats() as JSON to path (stderr when NULL) at exit, and whenever signal signum
+ * arrives unless it is 0. The handler only wakes a dump thread, which does the writing.
+ * Returns false when the thread or the handler cannot be set up. */
+bool set_stats_dump(const char *path, int signum) {
+	free(_stats_path);
+	_stats_path = path==NULL ? NULL : strdup(path);
+	if(!_stats_atexit)	_stats_atexit = atexit(stats_dump_file) == 0;
+	if(signum == 0)	return _stats_atexit;
+	if(!_stats_thread) {
+		pthread_t thread;
+		if(sem_init(&_stats_sem, 0, 0) != 0)	return false;
+		if(pthread_create(&thread, NULL, stats_dumper, NULL) != 0)	return false;
+		pthread_detach(thread);
+		_stats_thread = true;
+	}
+	return signal(signum, stats_signal) != SIG_ERR;
+}
+
+void stats_dump_file() {
+	FILE *out = _stats_path==NULL ? stderr : fopen(_stats_path, "a");
+	if(out == NULL)	return;
+	vm_stats_dump(out);
+	if(out != stderr)	fclose(out);
+}
+
+void stats_signal(int signum) {
+	sem_post(&_stats_sem);
+}
+
+void *stats_dumper(void *arg) {
+	for(;;) {
+		if(sem_wait(&_stats_sem) == 0)	stats_dump_file();
+	}
+	return NULL;
+}
+
+// runs at thread exit: unlink the reader record, the thread is quiescent from now on
+void ebr_release(void *arg) {
+	ebr_thread *rec = (ebr_thread*)arg;
+	pthread_mutex_lock(&_ebr_threads_mutex);
+	for(ebr_thread **pp=&_ebr_threads;*pp!=NULL;pp=&(*pp)->next)
+		if(*pp == rec) {
+			*pp = rec->next;
+			break;
+		}
+	pthread_mutex_unlock(&_ebr_threads_mutex);
+	free(rec);
+}
+
+void ebr_key_create() {
+	if(0 != pthread_key_create(&_ebr_key, ebr_release)) {
+		fprintf(stderr, "pthread_key_create(&_ebr_key) fails!\n");
+		exit(1);
+	}
+}
+
+ebr_thread *ebr_register() {
+	pthread_once(&_ebr_key_once, ebr_key_create);
+	ebr_thread *rec;
+	if(posix_memalign((void**)&rec, sizeof(ebr_thread), sizeof(ebr_thread)) != 0) {
+		fprintf(stderr, "posix_memalign for ebr_thread fails!\n");
+		exit(1);
+	}
+	memset(rec, 0, sizeof(ebr_thread));
+	pthread_setspecific(_ebr_key, rec);
+	pthread_mutex_lock(&_ebr_threads_mutex);
+	rec->next = _ebr_threads;
+	_ebr_threads = rec;
+	pthread_mutex_unlock(&_ebr_threads_mutex);
+	_ebr_local = rec;
+	return rec;
+}
+
+/* Start a read section. Page tables reachable from a pgd after this point stay allocated
+ * until the matching ebr_exit(). Sections nest. */
+void ebr_enter() {
+	ebr_thread *rec = _ebr_local;
+	if(rec == NULL)	rec = ebr_register();
+	if(rec->depth++ == 0)
+		// the announcement must be visible before the first load of a table pointer
+		__atomic_store_n(&rec->epoch, __atomic_load_n(&_ebr_epoch, __ATOMIC_RELAXED), __ATOMIC_SEQ_CST);
+}
+
+void ebr_exit() {
+	ebr_thread *rec = _ebr_local;
+	if(--rec->depth == 0)	__atomic_store_n(&rec->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* Defer table_free() of a table that has been unlinked from the page table. Called with
+ * _pagetable_lock held for writing (or from the single threaded a_free). */
+void ebr_retire(void *ptr) {
+	if(_ebr_limbonum == _ebr_limbocap) {
+		_ebr_limbocap = _ebr_limbocap==0 ? 64 : 2*_ebr_limbocap;
+		_ebr_limbo = (ebr_limbo*)realloc(_ebr_limbo, _ebr_limbocap*sizeof(ebr_limbo));
+		if(_ebr_limbo == NULL) {
+			fprintf(stderr, "realloc for _ebr_limbo fails!\n");
+			exit(1);
+		}
+	}
+	_ebr_limbo[_ebr_limbonum].ptr = ptr;
+	_ebr_limbo[_ebr_limbonum].epoch = __atomic_load_n(&_ebr_epoch, __ATOMIC_RELAXED);
+	++_ebr_limbonum;
+}
+
+/* Advance the global epoch if every reader inside a section has seen the current one, then
+ * free what was retired two epochs ago: no reader can still hold a pointer to it. */
+void ebr_reclaim() {
+	if(_ebr_limbonum == 0)	return;
+	uint64_t epoch = __atomic_load_n(&_ebr_epoch, __ATOMIC_SEQ_CST);
+	bool advance = true;
+	pthread_mutex_lock(&_ebr_threads_mutex);
+	for(ebr_thread *rec=_ebr_threads;rec!=NULL;rec=rec->next) {
+		uint64_t seen = __atomic_load_n(&rec->epoch, __ATOMIC_SEQ_CST);
+		if(seen!=0 && seen!=epoch) {
+			advance = false;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&_ebr_threads_mutex);
+	if(advance)	__atomic_store_n(&_ebr_epoch, ++epoch, __ATOMIC_SEQ_CST);
+
+	uint64_t kept = 0;
+	for(uint64_t i=0;i<_ebr_limbonum;++i) {
+		if(_ebr_limbo[i].epoch+2 <= epoch) {
+			table_free((address_t*)_ebr_limbo[i].ptr);
+			__atomic_sub_fetch(&_table_used, 1, __ATOMIC_RELAXED);
+		}else	_ebr_limbo[kept++] = _ebr_limbo[i];
+	}
+	_ebr_limbonum = kept;
+}
+
+/* Wait until every read section that was open when the call was made has ended. Called with
+ * _pagetable_lock held for writing, like ebr_reclaim(), and never from a read section. */
+void ebr_synchronize() {
+	uint64_t epoch = __atomic_add_fetch(&_ebr_epoch, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&_ebr_threads_mutex);
+	for(ebr_thread *rec=_ebr_threads;rec!=NULL;rec=rec->next) {
+		uint64_t seen;
+		while((seen=__atomic_load_n(&rec->epoch, __ATOMIC_SEQ_CST))!=0 && seen<epoch)	sched_yield();
+	}
+	pthread_mutex_unlock(&_ebr_threads_mutex);
+}
+
+void release_lock(pthread_rwlock_t *lock) {
+	if(0 != pthread_rwlock_unlock(lock)) {
+		fprintf(stderr, "pthread_rwlock_unlock(lock) fails!\n");
+		exit(1);
+	}
+}
 
+/* Lock acquisitions that have to block are counted and timed, per _pagetable_lock and per
+ * TLB locks, the other rwlocks. */
 void hold_rlock(pthread_rwlock_t *lock) {
+#ifndef VM_NO_STATS
+	if(pthread_rwlock_tryrdlock(lock) == 0)	return;
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+#endif
 	if(0 != pthread_rwlock_rdlock(lock)) {
 		fprintf(stderr, "pthread_rwlock_rdlock(lock) fails!\n");
 		exit(1);
 	}
+#ifndef VM_NO_STATS
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	stats_lock_wait(lock, &start, &end);
+#endif
 }
 
 void hold_wlock(pthread_rwlock_t *lock) {
+#ifndef VM_NO_STATS
+	if(pthread_rwlock_trywrlock(lock) == 0)	return;
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+#endif
 	if(0 != pthread_rwlock_wrlock(lock)) {
 		fprintf(stderr, "pthread_rwlock_wrlock(lock) fails!\n");
 		exit(1);
 	}
+#ifndef VM_NO_STATS
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	stats_lock_wait(lock, &start, &end);
+#endif
+}
+
+#ifndef VM_NO_STATS
+void stats_lock_wait(pthread_rwlock_t *lock, struct timespec *start, struct timespec *end) {
+	uint64_t ns = (end->tv_sec-start->tv_sec)*1000000000ULL + end->tv_nsec - start->tv_nsec;
+	if(lock == &_pagetable_lock) {
+		VM_COUNT(pt_lock_waits, 1);
+		VM_COUNT(pt_lock_wait_ns, ns);
+	}else {
+		VM_COUNT(tlb_lock_waits, 1);
+		VM_COUNT(tlb_lock_wait_ns, ns);
+	}
 }
+#endif
 
@@ -7,6 +7,19 @@
 #include <string.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MAT_SIMD 1
+#endif
 //Assume the address space is 48 bits, so the max memory size is 256*1024GB
 //Page size is 4KB
 
@@ -14,6 +27,14 @@
 
 #define PGSIZE 4096
 #define TLBSIZE 32
+// default TLB organization: TLBWAYS entries per set, 1 is direct mapped, TLBSIZE is fully associative
+#define TLBWAYS 4
+// fully associative TLB entries for 2 MiB mappings, next to the TLBSIZE entries for 4 KiB pages
+#define TLBHUGESIZE 8
+// number of recent shootdowns a thread private TLB can replay before it has to flush completely
+#define TLB_SHOOTDOWN_LOG 64
+// marks a shootdown log entry that invalidates a huge TLB entry
+#define TLB_SHOOT_HUGE (1ULL<<63)
 
 // Maximum size of your memory
 //#define MAX_MEMSIZE (uint64_t)1024*(uint64_t)1024*(uint64_t)1024
@@ -22,8 +43,88 @@
 //#define MAX_MEMSIZE 137438953472
 #define MAX_MEMSIZE 1073741824
 //#define MAX_MEMSIZE 34359738368
+// Size of the virtual address space handed out by a_malloc/umalloc, larger than the physical
+// memory so lazy allocations can overcommit
+#define MAX_VIRTSIZE (4*(uint64_t)MAX_MEMSIZE)
+// alignment of memstart, the size of a host huge page
+#define MEM_ALIGN (2*1024*1024)
 
 #define LEVELBITS 9
+// a pmd entry with PMD_HUGE maps HUGE_PAGES frames starting at the pfn in its low bits
+// instead of pointing to a pte table
+#define PMD_HUGE (1ULL<<63)
+#define HUGE_ORDER LEVELBITS
+#define HUGE_PAGES (1ULL<<HUGE_ORDER)
+// a pte with PTE_SWAPPED holds the swap slot of its page instead of a pfn, with PTE_COMPRESSED
+// the page is in the compressed tier rather than the swap file. PTE_ACCESSED is set by the
+// walks in swap mode and cleared by the CLOCK hand of swap_evict(). PTE_READONLY marks a
+// frame shared with a vm_clone() range, written only after page_fault() copied it
+#define PTE_SWAPPED (1ULL<<63)
+#define PTE_ACCESSED (1ULL<<62)
+#define PTE_COMPRESSED (1ULL<<61)
+#define PTE_READONLY (1ULL<<60)
+#define PTE_PFNMASK (~(PTE_SWAPPED|PTE_ACCESSED|PTE_COMPRESSED|PTE_READONLY))
+// _frame_pin flag of a pinned frame whose page has been freed
+#define FRAME_PIN_FREED (1U<<31)
+// _frame_vpn entry of a frame that does not back a 4K page
+#define SWAP_NOVPN UINT64_MAX
+// pages compressing to more than ZSWAP_MAXSIZE bytes skip the compressed tier
+#define ZSWAP_MAXSIZE (PGSIZE*3/4)
+// lz_compress() finds matches of at least LZ_MINMATCH bytes through a 2^LZ_HASHBITS table
+#define LZ_MINMATCH 4
+#define LZ_HASHBITS 12
+
+// address spaces of vm_context_create(), asid 0 is the default context. TLB entries and the
+// _frame_vpn reverse map key a page by its vpn tagged with the asid from bit VM_ASID_SHIFT up
+#define VM_MAXCONTEXTS 256
+#define VM_ASID_SHIFT 48
+#define VM_VPNMASK ((1ULL<<VM_ASID_SHIFT)-1)
+
+// native mode counts the host mappings again after at least NATIVE_MINSLACK mmap calls
+#define NATIVE_MINSLACK 64
+
+// summary levels kept above each bitmap, 64-way fan out per level
+#define BITMAP_MAXLEVELS 8
+#define BITMAP_NOTFOUND UINT64_MAX
+
+// largest block handed out by the physical frame allocator is 2^BUDDY_MAXORDER frames
+#define BUDDY_MAXORDER 30
+#define BUDDY_NIL UINT32_MAX
+// free blocks that merge up to 2^BUDDY_RELEASE_ORDER frames are released to the host
+#define BUDDY_RELEASE_ORDER 9
+
+// page tables live in frames: 1/2^TABLE_RESERVE_SHIFT of the frames are set aside for them at
+// startup, more are taken TABLE_POOL_BATCH at a time when those run out
+#define TABLE_RESERVE_SHIFT 9
+#define TABLE_POOL_BATCH 64
+// flag in the live count of a pte table a thread maps its small allocations in, see chunk_map()
+#define TABLE_CHUNK 0x8000
+
+// per thread frame cache: capacity, frames moved to or from the buddy allocator at once,
+// and the largest allocation served from the cache
+#define FRAME_CACHE_SIZE 64
+#define FRAME_CACHE_BATCH 32
+#define FRAME_CACHE_MAXPAGES 8
+
+// small requests are packed into slab pages, one size class per page: SLAB_MINSIZE,
+// 2*SLAB_MINSIZE, ..., SLAB_MAXSIZE bytes
+#define SLAB_MINSIZE 16
+#define SLAB_CLASSES 8
+#define SLAB_MAXSIZE (SLAB_MINSIZE<<(SLAB_CLASSES-1))
+#define SLAB_MAPWORDS (PGSIZE/SLAB_MINSIZE/64)
+
+// mat_mult works on MAT_TILE x MAT_TILE int tiles copied out of the virtual memory
+#define MAT_TILE 64
+
+// largest number of p_mat_mult worker threads
+#define POOL_MAXTHREADS 64
+
+// runs the copy paths translate in one go
+#define COPY_RUNS 16
+// native host buffers are copied through a bounce buffer of this size, see copy_value()
+#define COPY_BOUNCE 4096
+// batches of up to IOV_STACK entries are sorted without a heap allocation
+#define IOV_STACK 256
 
 typedef uint64_t address_t;
 
@@ -44,29 +145,253 @@ typedef uint64_t pte_t;
 
 typedef uint64_t pageno_t;
 
+// bytes at physical address pa, contiguous for len bytes, from translate_range(); pa is 0
+// for pages reserved by a lazy allocation but not backed by a frame yet, or swapped out.
+// Pages shared with a vm_clone() range are translated for reading only
+typedef struct vm_run{
+	address_t pa;
+	uint64_t len;
+}vm_run;
+
+// a range pinned by vm_pin(), runs[0..nruns) are its host memory in order
+typedef struct vm_pinned{
+	void *va;
+	uint64_t len;
+	uint32_t nruns;
+	uint32_t next;		// run returned by the next vm_pin_next()
+	vm_run runs[];
+}vm_pinned;
+
+// c[i][j] += a[i][k]*b[k][j] for i<rows, k<depth, j<cols over tiles with rows of MAT_TILE ints,
+// cols is a multiple of 8
+typedef void (*mat_kernel_t)(const int *a, const int *b, int *c, int rows, int depth, int cols);
+
+// a p_mat_mult call being run by the pool, one task per tile of answer
+typedef struct mat_job{
+	void *mat1;
+	void *mat2;
+	void *answer;
+	int size;
+	struct vm_context *ctx;	// address space of the caller, the workers switch to it
+	uint32_t tilecols;		// tiles per row of answer
+	uint32_t remaining;		// tasks not finished yet, the caller waits for 0
+	mat_kernel_t kernel;
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+}mat_job;
+
+typedef struct pool_task{
+	mat_job *job;
+	uint32_t tile;
+}pool_task;
+
+// tasks [head, tail) of a worker: the owner pops at the tail, other threads steal at the head
+typedef struct pool_deque{
+	pthread_mutex_t lock;
+	pool_task *task;
+	uint32_t head;
+	uint32_t tail;
+	uint32_t cap;
+}pool_deque;
+
+// one access of a put_valv()/get_valv() batch: size bytes between va and buf
+typedef struct vm_iovec{
+	void *va;
+	void *buf;
+	int size;
+}vm_iovec;
+
+// batch entry within a single page, sorted by vpn keeping the batch order within a page
+typedef struct vm_iosort{
+	pageno_t vpn;
+	int index;
+}vm_iosort;
+
+
+// counters of the compressed swap tier from zswap_stats(), bytes_in/bytes_out is the ratio
+typedef struct vm_zstats{
+	uint64_t stored;		// pages compressed
+	uint64_t rejected;		// pages that compressed poorly or did not fit the budget
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t pool_bytes;	// compressed bytes held now
+	uint64_t faults;		// pages decompressed on access
+	uint64_t fault_ns;		// time spent decompressing them
+}vm_zstats;
+
+// counters from vm_stats(), every field is a uint64_t. A build with VM_NO_STATS only keeps
+// the TLB counts and the gauges at the end
+typedef struct vm_counters{
+	uint64_t translations;		// translate_quiet() calls
+	uint64_t tlb_hits;
+	uint64_t tlb_misses;
+	uint64_t page_walks;
+	uint64_t shootdowns;		// tlb_freeupdate() and tlb_freerange() calls
+	uint64_t allocs;			// get_next_avail_vpn() calls
+	uint64_t alloc_scans;		// free runs looked at by bitmap_find_run()
+	uint64_t page_maps;
+	uint64_t frees;				// a_free() and ufree() calls
+	uint64_t pages_freed;
+	uint64_t page_faults;
+	uint64_t native_faults;		// host faults taken in the native region
+	uint64_t pt_lock_waits;		// _pagetable_lock acquisitions that had to block
+	uint64_t pt_lock_wait_ns;
+	uint64_t tlb_lock_waits;	// TLB lock acquisitions that had to block
+	uint64_t tlb_lock_wait_ns;
+	uint64_t table_bytes;		// page tables in use
+	uint64_t swap_ins;
+	uint64_t swap_outs;
+}vm_counters;
+
+// the counters of one thread, recycled by the next thread once it exits
+typedef struct stats_shard{
+	vm_counters count;
+	bool active;
+	struct stats_shard *next;
+}stats_shard;
+
+// hot path counters go to the shard of the calling thread without atomics or locks
+#ifdef VM_NO_STATS
+#define VM_COUNT(field, n) ((void)0)
+#else
+#define VM_COUNT(field, n) (stats_local()->count.field += (n))
+#endif
+
+// replacement policy used when a TLB set is full
+typedef enum tlb_policy{
+	TLB_LRU,
+	TLB_CLOCK,
+	TLB_RANDOM
+}tlb_policy;
+
+// TLB_SHARED: one TLB for all threads guarded by a rwlock per set
+// TLB_THREAD: a private TLB per thread, no locks on the hit path, kept coherent through the shootdown epoch
+typedef enum tlb_mode{
+	TLB_SHARED,
+	TLB_THREAD
+}tlb_mode;
 
 //Structure to represents TLB
 typedef struct tlb{
-    //Assume your TLB is a direct mapped TLB of TBL_SIZE (entries). You must also define wth TBL_SIZE in this file.
-    //Assume each bucket to be 4 bytes
+    //The TLB is TLBSIZE entries split into sets of _tlbways entries, set s holds entry[s*_tlbways ... (s+1)*_tlbways-1]
 	bool valid;
+	bool ref;			// CLOCK reference bit
 	pageno_t key;
 	pageno_t value;
+	uint64_t stamp;		// LRU last use
 }tlb;
-tlb _tlb_store[TLBSIZE];
 
-char *memstart;
+// one TLB instance, either the shared TLB or the private TLB of a thread
+typedef struct tlb_cache{
+	tlb entry[TLBSIZE];
+	uint64_t tick[TLBSIZE];		// per set LRU clock
+	uint32_t hand[TLBSIZE];		// per set CLOCK hand
+	tlb huge[TLBHUGESIZE];		// key is vpn>>HUGE_ORDER, value the first pfn of the mapping
+	uint64_t hugetick;
+	uint32_t hugehand;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t epoch;				// shootdowns before this epoch have been applied
+	uint32_t seed;				// RANDOM replacement state
+	struct tlb_cache *next;
+}tlb_cache;
+extern tlb_cache _tlb_shared;
+extern uint32_t _tlbways;
+extern uint32_t _tlbsets;
+extern tlb_policy _tlbpolicy;
+extern tlb_mode _tlbmode;
+
+/* Header in front of every bitmap. Summary level l has one bit per word of level l-1 (per
+ * 32 bit word of the bitmap itself for level 0): in nonfull it is set when that word has a
+ * clear bit, in nonempty when it has a set bit. */
+typedef struct bitmap_index{
+	uint64_t nbits;
+	uint64_t nwords;
+	uint32_t levels;
+	uint64_t levelwords[BITMAP_MAXLEVELS];
+	uint64_t *nonfull[BITMAP_MAXLEVELS];
+	uint64_t *nonempty[BITMAP_MAXLEVELS];
+	uint32_t bits[];
+}bitmap_index;
+
+/* Frames a thread keeps for itself so small umalloc/ufree calls do not touch the buddy
+ * allocator, and the pte table of virtual pages it maps them at without _pagetable_lock.
+ * The frames are guarded by lock, frame_cache_reclaim() drains the caches of all threads. */
+typedef struct frame_cache{
+	pthread_mutex_t lock;
+	uint32_t count;
+	pageno_t frame[FRAME_CACHE_SIZE];
+	pageno_t chunk;			// first vpn of the chunk, BITMAP_NOTFOUND without one
+	pte_t *chunk_table;
+	uint32_t chunk_next;	// where the search for free ptes of the chunk resumes
+	struct frame_cache *next;
+}frame_cache;
+
+// ALLOC_EAGER: frames are bound when the pages are allocated
+// ALLOC_LAZY: pages are only reserved and get a frame on their first write
+typedef enum alloc_mode{
+	ALLOC_EAGER,
+	ALLOC_LAZY
+}alloc_mode;
+
+// one page of equally sized objects, on the partial list of its class while it has free objects
+typedef struct slab{
+	pageno_t vpn;
+	uint32_t size;
+	uint32_t nfree;
+	uint32_t total;
+	uint64_t freemap[SLAB_MAPWORDS];	// bit set when the object is free
+	struct slab *next;
+	struct slab *prev;
+}slab;
+
+/* An address space: its own page table, virtual bitmap and slabs over the frame pool shared
+ * by all contexts. The slab lists are guarded by the class locks, everything else by
+ * _pagetable_lock like in a single address space. */
+typedef struct vm_context{
+	uint32_t asid;
+	pgd_t *pgd;
+	uint32_t *vbitmap;
+	slab ***slab_dir;		// vpn to the slab of that page, chunks of _tablesize entries made on demand
+	slab *slab_partial[SLAB_CLASSES];
+	pthread_mutex_t slab_lock[SLAB_CLASSES];
+}vm_context;
+
+// a thread that walks the page table without _pagetable_lock, see ebr_enter()
+typedef struct ebr_thread{
+	uint64_t epoch;			// epoch announced by the current read section, 0 when quiescent
+	uint32_t depth;
+	struct ebr_thread *next;
+	char pad[40];			// one record per cache line
+}ebr_thread;
+
+// a page table waiting until no walker can reference it
+typedef struct ebr_limbo{
+	void *ptr;
+	uint64_t epoch;
+}ebr_limbo;
+
+extern char *memstart;
 //pde_t *_pagedir;
-uint32_t *pbitmap;
-uint32_t *vbitmap;
-uint64_t _pagenum;
-uint32_t _offsetbits;
-uint32_t _tablesize;
-uint32_t _tlbmodbits;
+extern uint32_t *pbitmap;
+extern uint32_t *vbitmap;
+extern uint64_t _pagenum;
+extern uint64_t _vpagenum;
+extern uint32_t _offsetbits;
+extern uint32_t _tablesize;
+extern uint32_t _tlbmodbits;
 
+uint32_t *bitmap_create(uint64_t nbits);
+void bitmap_destroy(uint32_t *bitmap);
+bitmap_index *bitmap_get_index(uint32_t *bitmap);
+void bitmap_summarize(bitmap_index *index, uint64_t w);
 void set_bitmap(uint32_t *bitmap, uint64_t k);
 void clear_bitmap(uint32_t *bitmap, uint64_t k);
 bool get_bitmap(uint32_t *bitmap, uint64_t k);
+uint64_t bitmap_summary_next(bitmap_index *index, uint64_t **summary, uint64_t w);
+uint64_t bitmap_next_clear(uint32_t *bitmap, uint64_t k);
+uint64_t bitmap_next_set(uint32_t *bitmap, uint64_t k);
+uint64_t bitmap_find_run(uint32_t *bitmap, uint64_t num, uint64_t align);
 
 uint32_t get_pgdindex(address_t va);
 uint32_t get_pudindex(address_t va);
@@ -79,31 +404,192 @@ pageno_t get_next_avail_pfn();
 pageno_t transfer_ppntopfn(pageno_t ppn);
 pageno_t transfer_pfntoppn(pageno_t pfn);
 
-pthread_rwlock_t _pagetable_lock;
-pthread_rwlock_t _tlb_lock[TLBSIZE];
+void buddy_init();
+void buddy_push(pageno_t ppn, uint32_t order);
+void buddy_unlink(pageno_t ppn);
+pageno_t buddy_alloc(uint32_t order);
+void buddy_free(pageno_t ppn, uint32_t order);
+void buddy_free_range(pageno_t ppn, uint64_t num);
+uint64_t buddy_alloc_run(uint64_t num, pageno_t *ppn);
+
+void frame_cache_release(void *arg);
+void frame_key_create();
+frame_cache *frame_cache_current();
+void frame_cache_drain(frame_cache *cache, uint32_t num);
+bool frame_cache_get(uint64_t num, pageno_t *frames);
+void frame_cache_reclaim();
+void frame_free(pageno_t ppn);
+
+extern pthread_rwlock_t _pagetable_lock;
+extern pthread_rwlock_t _tlb_lock[TLBSIZE];
+extern pthread_rwlock_t _tlb_hugelock;
 
 void set_physical_mem();
+bool vm_context_init(vm_context *ctx);
+vm_context *vm_context_create();
+void vm_context_destroy(vm_context *ctx);
+vm_context *vm_switch(vm_context *ctx);
+vm_context *vm_current();
+pageno_t vm_tag(vm_context *ctx, pageno_t vpn);
+void set_alloc_mode(alloc_mode mode);
+void set_mem_hugepages(bool enable);
+void set_huge_mappings(bool enable);
 address_t translate(address_t va);
+address_t translate_quiet(address_t va, bool write, bool threadsafe);
+pageno_t pt_walk(pageno_t vpn, bool *huge);
+pte_t *pte_lookup(vm_context *ctx, pageno_t vpn);
+void pte_accessed(pte_t *pte, pte_t entry);
+pageno_t pt_walk_run(pageno_t vpn, uint64_t maxpages, bool write, uint64_t *npages);
+uint32_t translate_range(void *va, uint64_t len, vm_run *runs, uint32_t maxruns);
+uint32_t p_translate_range(void *va, uint64_t len, vm_run *runs, uint32_t maxruns);
+uint32_t translate_range_quiet(address_t va, uint64_t len, vm_run *runs, uint32_t maxruns, bool write, bool threadsafe);
 void* get_next_avail(uint64_t num_pages);
+pageno_t page_alloc(uint64_t num_pages, bool threadsafe);
+pageno_t get_next_avail_vpn(uint64_t num_pages, pageno_t *frames);
 bool page_map(pageno_t vpn, pageno_t pfn);
+pte_t *pte_create(vm_context *ctx, pageno_t vpn);
+bool page_map_huge(pageno_t vpn, pageno_t pfn);
+bool page_demote(pmd_t *pmdtable, uint32_t pmdindex, pageno_t vpn);
 void *a_malloc(uint64_t num_bytes);
 void a_free(void *va, uint64_t size);
+void unmap_pages(pageno_t vpn, uint64_t num_pages);
+void unmap_subtree(pud_t *pudtable, uint32_t pudindex, pageno_t vpn);
+void unmap_prune(pageno_t vpn, uint32_t level);
+void table_pool_init();
+void table_pool_add(pageno_t ppn, uint64_t num);
+bool table_pool_grow();
+bool table_reserve(pageno_t vpn, uint64_t num_pages);
+address_t *table_alloc();
+void table_free(address_t *table);
+uint16_t *table_live(address_t *table);
+void table_retire(address_t *table);
+bool page_fault(pageno_t vpn, bool write, bool threadsafe);
+bool page_fault_locked(pageno_t vpn, bool write);
+pageno_t page_frame();
+void frame_put(pageno_t ppn);
+void frame_unpin(pageno_t ppn);
+bool page_split(vm_context *ctx, pageno_t vpn);
+void *vm_clone(void *va, uint64_t size);
+vm_pinned *vm_pin(void *va, uint64_t len, void **ptr);
+void *vm_pin_next(vm_pinned *pin, uint64_t *len);
+void vm_unpin(vm_pinned *pin);
+/* The SIGSEGV handler of native mode runs page_fault_locked() under _pagetable_lock and the
+ * frame locks. A native address must not be touched from a signal handler, nor while the
+ * thread is inside the library; its errors go out through fault_error() and _exit()/abort(). */
+void set_native_mode(bool enable);
+void native_init();
+void *vm_native(void *va);
+address_t vm_address(void *ptr);
+void native_signal(int signum, siginfo_t *info, void *context);
+bool native_fault(pageno_t vpn);
+void native_map(pageno_t vpn, pageno_t pfn);
+void fault_error(const char *what, uint64_t num, const char *rest);
+void native_drop(pageno_t tag, uint64_t num);
+void native_budget();
+uint64_t native_mapcount();
+void native_reset();
+bool set_swap_file(const char *path);
+bool page_swapped(pageno_t vpn);
+uint64_t swap_hole(address_t va, uint64_t len);
+void set_swap_compress(uint64_t maxbytes);
+void swap_release(pte_t entry);
+bool zswap_store(uint64_t slot, void *frame);
+void zswap_load(uint64_t slot, void *frame);
+void zswap_stats(vm_zstats *stats);
+uint32_t lz_compress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t cap);
+uint32_t lz_emit(uint8_t *dst, uint32_t op, uint32_t cap, const uint8_t *lit, uint32_t nlit, uint32_t offset, uint32_t mlen);
+bool lz_decompress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t size);
+void swap_io(uint64_t slot, void *frame, bool write);
+pageno_t swap_evict();
+void swap_stats(uint64_t *swapins, uint64_t *swapouts);
+void copy_value(void *va, void *val, int size, bool write, bool threadsafe);
 void put_value(void *va, void *val, int size);
 void get_value(void *va, void *val, int size);
 void mat_mult(void *mat1, void *mat2, int size, void *answer);
+void mat_mult_tiled(void *mat1, void *mat2, int size, void *answer, bool threadsafe);
+void mat_mult_tile(void *mat1, void *mat2, int size, void *answer, int ib, int jb, mat_kernel_t kernel, bool threadsafe);
+mat_kernel_t mat_select_kernel();
+void mat_kernel_scalar(const int *a, const int *b, int *c, int rows, int depth, int cols);
+#ifdef MAT_SIMD
+void mat_kernel_sse41(const int *a, const int *b, int *c, int rows, int depth, int cols);
+void mat_kernel_avx2(const int *a, const int *b, int *c, int rows, int depth, int cols);
+#endif
 
-void tlb_add(pageno_t vpn, pageno_t pfn);
+void set_pool_size(uint32_t nthreads);
+uint32_t get_pool_size();
+void pool_shutdown();
+void pool_start();
+void pool_push(uint32_t w, pool_task task);
+bool pool_take(int self, pool_task *task);
+void pool_run(pool_task task);
+void *pool_worker(void *arg);
+
+void set_tlb_config(uint32_t ways, tlb_policy policy);
+void set_tlb_mode(tlb_mode mode);
+void tlb_init();
+void tlb_cache_flush(tlb_cache *cache);
+void tlb_cache_release(void *arg);
+void tlb_key_create();
+tlb_cache *tlb_current();
+void tlb_count(uint64_t *counter);
+uint32_t tlb_set(pageno_t vpn);
+void tlb_touch(tlb *entry, uint64_t *tick);
+void tlb_insert(tlb_cache *cache, tlb *entry, uint32_t ways, uint64_t *tick, uint32_t *hand, pageno_t key, pageno_t value);
+void tlb_add(pageno_t vpn, pageno_t pfn, bool huge);
+void tlb_fill(pageno_t vpn, pageno_t pfn, uint64_t epoch, bool huge);
 uint64_t tlb_lookup(pageno_t vpn);
-void tlb_freeupdate(pageno_t vpn);
+uint64_t tlb_lookup_huge(pageno_t vpn);
+void tlb_invalidate(tlb_cache *cache, pageno_t vpn, bool huge);
+void tlb_freeupdate(pageno_t vpn, bool huge);
+void tlb_freerange(pageno_t vpn, uint64_t num);
+void tlb_stats(uint64_t *hits, uint64_t *misses);
+void print_TLB_missrate();
+
+stats_shard *stats_local();
+void stats_release(void *arg);
+void stats_key_create();
+void vm_stats(vm_counters *stats);
+void vm_stats_dump(FILE *out);
+bool set_stats_dump(const char *path, int signum);
+void stats_dump_file();
+#ifndef VM_NO_STATS
+void stats_lock_wait(pthread_rwlock_t *lock, struct timespec *start, struct timespec *end);
+#endif
+void stats_signal(int signum);
+void *stats_dumper(void *arg);
 
 void *umalloc(uint64_t num_bytes);
 void ufree(void *va, uint64_t size);
+pageno_t chunk_map(uint64_t num_pages, pageno_t *frames);
+bool chunk_unmap(pageno_t vpn, uint64_t num_pages);
+void chunk_reserve(frame_cache *cache);
+void chunk_release(frame_cache *cache);
 void put_val(void *va, void *val, int size);
 void get_val(void *va, void *val, int size);
+vm_iosort *iosort_radix(vm_iosort *order, vm_iosort *tmp, int m, pageno_t minvpn, pageno_t maxvpn);
+void copy_valuev(vm_iovec *iov, int n, bool write, bool threadsafe);
+void put_valv(vm_iovec *iov, int n);
+void get_valv(vm_iovec *iov, int n);
 void p_mat_mult(void *mat1, void *mat2, int size, void *answer);
 void hold_rlock(pthread_rwlock_t *lock);
 void hold_wlock(pthread_rwlock_t *lock);
 void release_lock(pthread_rwlock_t *lock);
 address_t p_translate(address_t va);
 
+uint32_t slab_class(uint64_t num_bytes);
+slab *slab_lookup(pageno_t vpn);
+void slab_setdir(pageno_t vpn, slab *s);
+void slab_unlink(uint32_t class, slab *s);
+void *slab_alloc(uint64_t num_bytes, bool threadsafe);
+bool slab_free(void *va, bool threadsafe);
+
+void ebr_release(void *arg);
+void ebr_key_create();
+ebr_thread *ebr_register();
+void ebr_enter();
+void ebr_exit();
+void ebr_retire(void *ptr);
+void ebr_reclaim();
+void ebr_synchronize();
+
 #endif